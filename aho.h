@@ -0,0 +1,246 @@
+#ifndef __aho_h
+#define __aho_h
+
+#include <stddef.h>
+#include <string.h>
+#include "errors.h"
+
+/*
+ * Aho-Corasick automaton, finds any number of patterns in one pass.
+ *
+ * Patterns are added with ac_add, then ac_compile turns the trie into a
+ * full transition table, so scanning is one table lookup per byte with
+ * no failure links to follow. Bytes no pattern has share one class, so
+ * the table has a column per distinct pattern byte plus one, not 256.
+ * After ac_compile the automaton is only read, and any number of
+ * threads may scan with it, each with its own state and ac_match_t.
+ *
+ * The state carries over between calls, so a stream is scanned in blocks
+ * of any size without overlap and matches across blocks are found.
+ */
+typedef struct ac_tag {
+	int				patterns;
+	char				**pattern;
+	size_t				*length;
+	// next pattern ending at the same state, for duplicates, or -1
+	int				*same;
+	int				classes;
+	unsigned char			class[256];
+	int				states;
+	int				capacity;
+	// states x classes, the state after reading a byte of a class
+	int				*next;
+	// first pattern ending at a state, or -1
+	int				*match;
+	// nearest state on the failure chain with a pattern ending, or -1
+	int				*dict;
+	// a pattern ends at the state or a state on its failure chain
+	char				*output;
+}ac_t;
+
+/* patterns found by one scan, each once, in order found */
+typedef struct ac_match_tag {
+	char				*seen;
+	int				*found;
+	int				count;
+}ac_match_t;
+
+static inline void ac_init(ac_t *ac)
+{
+	memset(ac, 0, sizeof(ac_t));
+}
+
+/* add a copy of pattern, before ac_compile */
+static inline void ac_add(ac_t *ac, const char *pattern, size_t length)
+{
+	if ((ac->patterns & (ac->patterns - 1)) == 0) {
+		// grow by doubling at each power of 2
+		ac->pattern = realloc(ac->pattern, (ac->patterns * 2 + 1) * sizeof(char *));
+		ac->length = realloc(ac->length, (ac->patterns * 2 + 1) * sizeof(size_t));
+		ac->same = realloc(ac->same, (ac->patterns * 2 + 1) * sizeof(int));
+		if (ac->pattern == NULL || ac->length == NULL || ac->same == NULL) {
+			errno_abort("Allocate memory for patterns");
+		}
+	}
+	ac->pattern[ac->patterns] = malloc(length + 1);
+	if (ac->pattern[ac->patterns] == NULL) {
+		errno_abort("Allocate memory for pattern");
+	}
+	memcpy(ac->pattern[ac->patterns], pattern, length);
+	ac->pattern[ac->patterns][length] = '\0';
+	ac->length[ac->patterns] = length;
+	ac->same[ac->patterns] = -1;
+	++ac->patterns;
+}
+
+/* add a state with no transitions yet, return it */
+static inline int ac_state(ac_t *ac)
+{
+	int i;
+
+	if (ac->states == ac->capacity) {
+		ac->capacity = ac->capacity == 0 ? 64 : ac->capacity * 2;
+		ac->next = realloc(ac->next, (size_t)ac->capacity * ac->classes * sizeof(int));
+		ac->match = realloc(ac->match, ac->capacity * sizeof(int));
+		if (ac->next == NULL || ac->match == NULL) {
+			errno_abort("Allocate memory for automaton");
+		}
+	}
+	for (i = 0; i < ac->classes; ++i) {
+		ac->next[(size_t)ac->states * ac->classes + i] = -1;
+	}
+	ac->match[ac->states] = -1;
+	return ac->states++;
+}
+
+/* build the transition table from the patterns added */
+static inline void ac_compile(ac_t *ac)
+{
+	int p, c, state, child, fail, head, tail, *queue, *link;
+	size_t i;
+	unsigned char byte;
+
+	// class 0 for bytes in no pattern
+	memset(ac->class, 0, sizeof(ac->class));
+	ac->classes = 1;
+	for (p = 0; p < ac->patterns; ++p) {
+		for (i = 0; i < ac->length[p]; ++i) {
+			byte = ac->pattern[p][i];
+			if (ac->class[byte] == 0) {
+				ac->class[byte] = ac->classes++;
+			}
+		}
+	}
+
+	// trie, -1 where there is no child yet
+	ac_state(ac);
+	for (p = 0; p < ac->patterns; ++p) {
+		state = 0;
+		for (i = 0; i < ac->length[p]; ++i) {
+			c = ac->class[(unsigned char)ac->pattern[p][i]];
+			child = ac->next[(size_t)state * ac->classes + c];
+			if (child < 0) {
+				child = ac_state(ac);
+				ac->next[(size_t)state * ac->classes + c] = child;
+			}
+			state = child;
+		}
+		ac->same[p] = ac->match[state];
+		ac->match[state] = p;
+	}
+
+	// breadth first, a state's failure state is done before it, so its row can fill the gaps
+	queue = malloc(ac->states * sizeof(int));
+	link = malloc(ac->states * sizeof(int));
+	ac->dict = malloc(ac->states * sizeof(int));
+	ac->output = malloc(ac->states);
+	if (queue == NULL || link == NULL || ac->dict == NULL || ac->output == NULL) {
+		errno_abort("Allocate memory for automaton");
+	}
+	link[0] = 0;
+	ac->dict[0] = -1;
+	ac->output[0] = ac->match[0] >= 0;
+	head = tail = 0;
+	for (c = 0; c < ac->classes; ++c) {
+		child = ac->next[c];
+		if (child < 0) {
+			ac->next[c] = 0;
+		} else {
+			link[child] = 0;
+			queue[tail++] = child;
+		}
+	}
+	while (head < tail) {
+		state = queue[head++];
+		fail = link[state];
+		ac->dict[state] = ac->match[fail] >= 0 ? fail : ac->dict[fail];
+		ac->output[state] = ac->match[state] >= 0 || ac->dict[state] >= 0;
+		for (c = 0; c < ac->classes; ++c) {
+			child = ac->next[(size_t)state * ac->classes + c];
+			if (child < 0) {
+				ac->next[(size_t)state * ac->classes + c] = ac->next[(size_t)fail * ac->classes + c];
+			} else {
+				link[child] = ac->next[(size_t)fail * ac->classes + c];
+				queue[tail++] = child;
+			}
+		}
+	}
+	free(queue);
+	free(link);
+}
+
+static inline void ac_destroy(ac_t *ac)
+{
+	int p;
+
+	for (p = 0; p < ac->patterns; ++p) {
+		free(ac->pattern[p]);
+	}
+	free(ac->pattern);
+	free(ac->length);
+	free(ac->same);
+	free(ac->next);
+	free(ac->match);
+	free(ac->dict);
+	free(ac->output);
+}
+
+static inline void ac_match_init(ac_match_t *match, const ac_t *ac)
+{
+	match->seen = calloc(ac->patterns + 1, 1);
+	match->found = malloc((ac->patterns + 1) * sizeof(int));
+	if (match->seen == NULL || match->found == NULL) {
+		errno_abort("Allocate memory for pattern matches");
+	}
+	match->count = 0;
+}
+
+/* forget the patterns found, for the next scan */
+static inline void ac_match_reset(ac_match_t *match)
+{
+	while (match->count > 0) {
+		match->seen[match->found[--match->count]] = 0;
+	}
+}
+
+static inline void ac_match_destroy(ac_match_t *match)
+{
+	free(match->seen);
+	free(match->found);
+}
+
+/*
+ * scan size bytes of data from *state, record patterns found in match,
+ * return 1 when all patterns are found, so the rest needn't be scanned
+ */
+static inline int ac_scan(const ac_t *ac, int *state, const char *data, size_t size,
+		ac_match_t *match)
+{
+	const unsigned char *byte = (const unsigned char *)data, *end = byte + size;
+	const unsigned char *class = ac->class;
+	const int *next = ac->next;
+	const char *output = ac->output;
+	int classes = ac->classes, current = *state, found, p;
+
+	while (byte < end) {
+		current = next[current * classes + class[*byte++]];
+		if (!output[current]) {
+			continue;
+		}
+		for (found = ac->match[current] >= 0 ? current : ac->dict[current]; found >= 0; found = ac->dict[found]) {
+			for (p = ac->match[found]; p >= 0; p = ac->same[p]) {
+				if (!match->seen[p]) {
+					match->seen[p] = 1;
+					match->found[match->count++] = p;
+				}
+			}
+		}
+		if (match->count == ac->patterns) {
+			break;
+		}
+	}
+	*state = current;
+	return match->count == ac->patterns;
+}
+
+#endif
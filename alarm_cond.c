@@ -1,212 +1,1499 @@
 #include <pthread.h>
+#include <time.h>
+#include <limits.h>
 #include "errors.h"
+#include "pool.h"
+
+/* nanoseconds on CLOCK_MONOTONIC */
+typedef long long nsec_t;
+
+#define	NSEC_PER_SEC	1000000000LL
+/* longest alarm a command may set, far from overflowing nsec_t when added to now */
+#define	MAX_SECONDS	(366 * 24 * 60 * 60)
+
+/* default number of dispatcher threads running alarm actions */
+#define	WORKER_COUNT	4
+/* lateness histogram, bucket n counts alarms late less than 2^n microseconds */
+#define	LATE_BUCKETS	32
 
 typedef struct alarm_tag {
 	struct alarm_tag	*link;			/* point to next alarm */
-	time_t			time;			/* expiration time from Epoch */
-	int			seconds;		/* relative time */
+	struct alarm_tag	**pprev;		/* point to link pointing to this alarm */
+	struct alarm_tag	*hash_link;		/* next alarm in handle hash bucket */
+	unsigned long		id;			/* alarm handle */
+	nsec_t			time;			/* expiration time on CLOCK_MONOTONIC */
+	size_t			index;			/* position in heap */
+	double			seconds;		/* relative time */
+	void			(*action)(struct alarm_tag *alarm, nsec_t late);	/* called by worker when expired */
 	char			message[64 + 1];	/* alarm message */
 }alarm_t;
 
-/* protect access to alarm list */
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-/* signal change to alarm list */
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
+typedef struct worker_tag {
+	pthread_t		thread;
+	int			index;
+	long			fired;			/* alarms run by this worker */
+	nsec_t			late_total;
+	nsec_t			late_max;
+	long			histogram[LATE_BUCKETS];
+}worker_t;
+
+/*
+ * Expired alarms handed off by the alarm thread, workers take one alarm at
+ * a time so a slow action only delays its own worker.
+ */
+typedef struct dispatch_tag {
+	pthread_mutex_t		mutex;
+	pthread_cond_t		avail;			/* predicate: first != NULL or done */
+	alarm_t			*first;
+	alarm_t			*last;
+	int			done;			/* no more alarms will be dispatched */
+}dispatch_t;
+
+typedef struct shard_tag shard_t;
+
+/*
+ * Timer queue backend. Every backend keeps pending alarms of a shard
+ * ordered by expiration time, caller MUST have shard mutex locked.
+ *
+ * insert	add an alarm to the queue
+ * remove	remove a pending alarm from the queue
+ * pop_expired	remove and return an alarm expired at now, or NULL
+ * expire	detach all alarms expired at now as a list linked by link,
+ *		return the number of alarms
+ * next_time	set *when to the time the alarm thread should wake up,
+ *		return 0 if queue is empty
+ */
+typedef struct queue_tag {
+	const char		*name;
+	void			(*init)(shard_t *shard, nsec_t now);
+	void			(*insert)(shard_t *shard, alarm_t *alarm);
+	void			(*remove)(shard_t *shard, alarm_t *alarm);
+	alarm_t			*(*pop_expired)(shard_t *shard, nsec_t now);
+	int			(*expire)(shard_t *shard, nsec_t now, alarm_t **first, alarm_t **last);
+	int			(*next_time)(shard_t *shard, nsec_t *when);
+}queue_t;
+
+/* alarm thread counters of a shard */
+typedef struct stats_tag {
+	long			wakeups;		/* returns from wait on shard cond */
+	long			timeouts;		/* wakeups by timed wait expiration */
+	long			preempted;		/* wakeups by a new earlier alarm, each used to reinsert the head alarm */
+	long			spurious;		/* wakeups by neither */
+	long			batches;		/* critical sections that expired alarms */
+	long			expired;		/* alarms expired */
+	long			max_batch;		/* most alarms expired in one critical section */
+}stats_t;
+
+#define	WHEEL_BITS	6
+#define	WHEEL_SIZE	(1 << WHEEL_BITS)
+#define	WHEEL_LEVELS	5
+
+/*
+ * Alarms are sharded over independent timer queues, each with its own
+ * lock, condition variable and alarm thread, so producers on different
+ * shards don't contend. Each producer thread sticks to one shard, chosen
+ * round robin when it first inserts. Alarm handle is id * shard_count +
+ * shard index, so cancel and reschedule find the shard without a lookup.
+ */
+struct shard_tag {
+	pthread_mutex_t		mutex;			/* protect access to shard */
+	pthread_cond_t		cond;			/* signal change to queue, waits on CLOCK_MONOTONIC */
+	pthread_t		thread;			/* alarm thread */
+	int			index;
+	int			done;			/* main thread set when exit, alarm thread exits when queue is empty */
+	nsec_t			current_time;		/* optimization for signal, only queue is empty or insert a new earlier alarm */
+	stats_t			stats;
+
+	/* sorted list backend */
+	alarm_t			*list;
+
+	/* heap backend */
+	alarm_t			**heap;
+	size_t			heap_size;
+	size_t			heap_capacity;
+
+	/* timing wheel backend */
+	alarm_t			*wheel_slot[WHEEL_LEVELS][WHEEL_SIZE];
+	alarm_t			*wheel_overflow;
+	nsec_t			wheel_now;
+
+	/* alarm handles hashed by id */
+	alarm_t			**hash;
+	size_t			hash_size;
+	size_t			alarm_count;
+	unsigned long		next_id;
+};
+
+shard_t *shards = NULL;
+int shard_count = 1;
+
+/* shard of the calling producer thread, assigned round robin */
+pthread_key_t shard_key;
+pthread_mutex_t shard_next_mutex = PTHREAD_MUTEX_INITIALIZER;
+int shard_next = 0;
+
+dispatch_t dispatch = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	NULL,
+	NULL,
+	0
+};
+
+worker_t *workers = NULL;
+int worker_count = WORKER_COUNT;
+
+/* alarms are allocated by producers and freed by workers */
+pool_t alarm_pool;
+
+
+
+/* link alarm at head of a list or wheel slot */
+void link_alarm(alarm_t **head, alarm_t *alarm)
+{
+	alarm->link = *head;
+	if (*head != NULL) {
+		(*head)->pprev = &alarm->link;
+	}
+	alarm->pprev = head;
+	*head = alarm;
+}
+
+/* unlink alarm from its list or wheel slot without walking it */
+void unlink_alarm(alarm_t *alarm)
+{
+	*alarm->pprev = alarm->link;
+	if (alarm->link != NULL) {
+		alarm->link->pprev = alarm->pprev;
+	}
+}
+
+/* append alarm to a list being expired */
+void append_alarm(alarm_t **first, alarm_t **last, alarm_t *alarm)
+{
+	if (*first == NULL) {
+		*first = alarm;
+	} else {
+		(*last)->link = alarm;
+	}
+	*last = alarm;
+	alarm->link = NULL;
+}
+
+
+/*
+ * Sorted linked list backend, O(N) insert, O(1) pop
+ */
+void list_init(shard_t *shard, nsec_t now)
+{
+	shard->list = NULL;
+}
+
+void list_insert(shard_t *shard, alarm_t *alarm)
+{
+	alarm_t **last = &shard->list;
+
+	/* insert after alarms with the same time */
+	while (*last != NULL && (*last)->time <= alarm->time) {
+		last = &(*last)->link;
+	}
+	link_alarm(last, alarm);
+}
+
+alarm_t *list_pop_expired(shard_t *shard, nsec_t now)
+{
+	alarm_t *alarm = shard->list;
+
+	if (alarm == NULL || alarm->time > now) {
+		return NULL;
+	}
+	unlink_alarm(alarm);
+	return alarm;
+}
+
+/* expired alarms are a prefix of the list, detach it at once */
+int list_expire(shard_t *shard, nsec_t now, alarm_t **first, alarm_t **last)
+{
+	int count = 0;
+	alarm_t **link = &shard->list;
+
+	*last = NULL;
+	while (*link != NULL && (*link)->time <= now) {
+		*last = *link;
+		link = &(*link)->link;
+		++count;
+	}
+
+	if (count == 0) {
+		*first = NULL;
+		return 0;
+	}
+	*first = shard->list;
+	shard->list = *link;
+	if (shard->list != NULL) {
+		shard->list->pprev = &shard->list;
+	}
+	(*last)->link = NULL;
+	return count;
+}
+
+void list_remove(shard_t *shard, alarm_t *alarm)
+{
+	unlink_alarm(alarm);
+}
+
+int list_next_time(shard_t *shard, nsec_t *when)
+{
+	if (shard->list == NULL) {
+		return 0;
+	}
+	*when = shard->list->time;
+	return 1;
+}
+
+
+/*
+ * Binary min-heap backend, O(log N) insert and pop
+ */
+void heap_set(shard_t *shard, size_t index, alarm_t *alarm)
+{
+	shard->heap[index] = alarm;
+	alarm->index = index;
+}
+
+void heap_init(shard_t *shard, nsec_t now)
+{
+	shard->heap_size = 0;
+}
+
+/* move alarm up from index to its place */
+void heap_sift_up(shard_t *shard, size_t index, alarm_t *alarm)
+{
+	size_t parent;
+
+	while (index > 0) {
+		parent = (index - 1) / 2;
+		if (shard->heap[parent]->time <= alarm->time) {
+			break;
+		}
+		heap_set(shard, index, shard->heap[parent]);
+		index = parent;
+	}
+	heap_set(shard, index, alarm);
+}
+
+/* move alarm down from index to its place */
+void heap_sift_down(shard_t *shard, size_t index, alarm_t *alarm)
+{
+	size_t child;
+
+	while ((child = 2 * index + 1) < shard->heap_size) {
+		if (child + 1 < shard->heap_size && shard->heap[child + 1]->time < shard->heap[child]->time) {
+			++child;
+		}
+		if (alarm->time <= shard->heap[child]->time) {
+			break;
+		}
+		heap_set(shard, index, shard->heap[child]);
+		index = child;
+	}
+	heap_set(shard, index, alarm);
+}
+
+void heap_insert(shard_t *shard, alarm_t *alarm)
+{
+	if (shard->heap_size == shard->heap_capacity) {
+		shard->heap_capacity = shard->heap_capacity == 0 ? 64 : shard->heap_capacity * 2;
+		shard->heap = realloc(shard->heap, shard->heap_capacity * sizeof(alarm_t *));
+		if (shard->heap == NULL) {
+			errno_abort("Allocate memory for alarm heap");
+		}
+	}
+	heap_sift_up(shard, shard->heap_size++, alarm);
+}
+
+/* fill the hole with the last leaf, alarm->index makes it O(log N) */
+void heap_remove(shard_t *shard, alarm_t *alarm)
+{
+	alarm_t *last = shard->heap[--shard->heap_size];
+
+	if (alarm->index == shard->heap_size) {
+		return;
+	}
+	if (alarm->index > 0 && last->time < shard->heap[(alarm->index - 1) / 2]->time) {
+		heap_sift_up(shard, alarm->index, last);
+	} else {
+		heap_sift_down(shard, alarm->index, last);
+	}
+}
+
+alarm_t *heap_pop_expired(shard_t *shard, nsec_t now)
+{
+	alarm_t *alarm;
+
+	if (shard->heap_size == 0 || shard->heap[0]->time > now) {
+		return NULL;
+	}
+	alarm = shard->heap[0];
+	heap_remove(shard, alarm);
+	return alarm;
+}
+
+int heap_expire(shard_t *shard, nsec_t now, alarm_t **first, alarm_t **last)
+{
+	int count = 0;
+	alarm_t *alarm;
+
+	*first = *last = NULL;
+	while ((alarm = heap_pop_expired(shard, now)) != NULL) {
+		append_alarm(first, last, alarm);
+		++count;
+	}
+	return count;
+}
+
+int heap_next_time(shard_t *shard, nsec_t *when)
+{
+	if (shard->heap_size == 0) {
+		return 0;
+	}
+	*when = shard->heap[0]->time;
+	return 1;
+}
+
+
+/*
+ * Hierarchical timing wheel backend, O(1) insert, amortized O(levels) pop.
+ *
+ * Wheel time is counted in ticks of 2^WHEEL_TICK nanoseconds (about 1ms).
+ * Level 0 has one slot per tick, a slot on level n covers 64^n ticks.
+ * Alarm is placed on the level of the highest 6 bits group in which its
+ * expiration tick differs from wheel_now, and cascaded to lower levels
+ * when wheel_now reaches the slot. Alarms beyond the range of the top
+ * level are kept in wheel_overflow until wheel_now enters their range.
+ */
+#define	WHEEL_TICK	20
+#define	WHEEL_MASK	(WHEEL_SIZE - 1)
+#define	WHEEL_RANGE	(WHEEL_BITS * WHEEL_LEVELS)
+
+int wheel_index(nsec_t tick, int level)
+{
+	return (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+}
+
+void wheel_place(shard_t *shard, alarm_t *alarm)
+{
+	int level = 0;
+	nsec_t expires = alarm->time >> WHEEL_TICK;
+	nsec_t diff;
+
+	if (expires < shard->wheel_now) {
+		expires = shard->wheel_now;
+	}
+	diff = expires ^ shard->wheel_now;
+	while (level < WHEEL_LEVELS && (diff >> (WHEEL_BITS * (level + 1))) != 0) {
+		++level;
+	}
+
+	if (level == WHEEL_LEVELS) {
+		link_alarm(&shard->wheel_overflow, alarm);
+	} else {
+		link_alarm(&shard->wheel_slot[level][wheel_index(expires, level)], alarm);
+	}
+}
+
+/* move alarm list from a slot or overflow list back into the wheel */
+void wheel_redistribute(shard_t *shard, alarm_t **head)
+{
+	alarm_t *alarm = *head, *next;
+
+	*head = NULL;
+	while (alarm != NULL) {
+		next = alarm->link;
+		wheel_place(shard, alarm);
+		alarm = next;
+	}
+}
+
+void wheel_advance(shard_t *shard, nsec_t tick)
+{
+	int crossed = (tick >> WHEEL_RANGE) != (shard->wheel_now >> WHEEL_RANGE);
+
+	shard->wheel_now = tick;
+	if (crossed) {
+		wheel_redistribute(shard, &shard->wheel_overflow);
+	}
+}
+
+/* return the link pointing to the earliest alarm of a slot */
+alarm_t **wheel_earliest(alarm_t **slot)
+{
+	alarm_t **earliest = slot;
+
+	for (slot = &(*slot)->link; *slot != NULL; slot = &(*slot)->link) {
+		if ((*slot)->time < (*earliest)->time) {
+			earliest = slot;
+		}
+	}
+	return earliest;
+}
+
+/*
+ * Find the first occupied slot at or after wheel_now, and set *tick to the
+ * start of the slot, where upper level slots must be cascaded. Return
+ * WHEEL_LEVELS for overflow, -1 if wheel is empty.
+ */
+int wheel_next_slot(shard_t *shard, nsec_t *tick)
+{
+	int level, slot;
+	nsec_t base;
+
+	for (level = 0; level < WHEEL_LEVELS; ++level) {
+		slot = wheel_index(shard->wheel_now, level) + (level > 0);
+		for (; slot < WHEEL_SIZE; ++slot) {
+			if (shard->wheel_slot[level][slot] != NULL) {
+				base = shard->wheel_now >> (WHEEL_BITS * (level + 1));
+				*tick = ((base << WHEEL_BITS) | slot) << (WHEEL_BITS * level);
+				return level;
+			}
+		}
+	}
+
+	if (shard->wheel_overflow == NULL) {
+		return -1;
+	}
+	*tick = (*wheel_earliest(&shard->wheel_overflow))->time >> WHEEL_TICK;
+	return WHEEL_LEVELS;
+}
+
+void wheel_init(shard_t *shard, nsec_t now)
+{
+	memset(shard->wheel_slot, 0, sizeof(shard->wheel_slot));
+	shard->wheel_overflow = NULL;
+	shard->wheel_now = now >> WHEEL_TICK;
+}
+
+void wheel_insert(shard_t *shard, alarm_t *alarm)
+{
+	wheel_place(shard, alarm);
+}
+
+alarm_t *wheel_pop_expired(shard_t *shard, nsec_t now)
+{
+	int level;
+	nsec_t tick;
+	alarm_t **slot, *alarm;
+
+	while ((level = wheel_next_slot(shard, &tick)) >= 0 && tick <= now >> WHEEL_TICK) {
+		wheel_advance(shard, tick);
+		if (level == 0) {
+			// alarms in a level 0 slot share the tick, but not the nanoseconds
+			slot = wheel_earliest(&shard->wheel_slot[0][wheel_index(tick, 0)]);
+			if ((*slot)->time > now) {
+				return NULL;
+			}
+			alarm = *slot;
+			unlink_alarm(alarm);
+			return alarm;
+		}
+		if (level < WHEEL_LEVELS) {
+			wheel_redistribute(shard, &shard->wheel_slot[level][wheel_index(tick, level)]);
+		}
+	}
+
+	if (now >> WHEEL_TICK > shard->wheel_now) {
+		wheel_advance(shard, now >> WHEEL_TICK);
+	}
+	return NULL;
+}
+
+void wheel_remove(shard_t *shard, alarm_t *alarm)
+{
+	unlink_alarm(alarm);
+}
+
+int wheel_expire(shard_t *shard, nsec_t now, alarm_t **first, alarm_t **last)
+{
+	int count = 0;
+	nsec_t tick;
+	alarm_t **slot, *alarm;
+
+	*first = *last = NULL;
+	while (1) {
+		if (wheel_next_slot(shard, &tick) == 0 && ((tick + 1) << WHEEL_TICK) - 1 <= now) {
+			// whole level 0 slot is expired, detach it at once
+			wheel_advance(shard, tick);
+			slot = &shard->wheel_slot[0][wheel_index(tick, 0)];
+			if (*first == NULL) {
+				*first = *slot;
+			} else {
+				(*last)->link = *slot;
+			}
+			for (alarm = *slot; alarm != NULL; alarm = alarm->link) {
+				*last = alarm;
+				++count;
+			}
+			*slot = NULL;
+		} else if ((alarm = wheel_pop_expired(shard, now)) != NULL) {
+			append_alarm(first, last, alarm);
+			++count;
+		} else {
+			break;
+		}
+	}
+	return count;
+}
+
+int wheel_next_time(shard_t *shard, nsec_t *when)
+{
+	int level = wheel_next_slot(shard, when);
+
+	if (level < 0) {
+		return 0;
+	}
+	if (level == 0) {
+		*when = (*wheel_earliest(&shard->wheel_slot[0][wheel_index(*when, 0)]))->time;
+	} else {
+		*when <<= WHEEL_TICK;
+	}
+	return 1;
+}
+
+
+queue_t queues[] = {
+	{"list", list_init, list_insert, list_remove, list_pop_expired, list_expire, list_next_time},
+	{"heap", heap_init, heap_insert, heap_remove, heap_pop_expired, heap_expire, heap_next_time},
+	{"wheel", wheel_init, wheel_insert, wheel_remove, wheel_pop_expired, wheel_expire, wheel_next_time},
+};
+
+#define	QUEUE_COUNT	(sizeof(queues) / sizeof(queues[0]))
+
+queue_t *queue = &queues[1];
+
+queue_t *find_queue(const char *name)
+{
+	int i;
+
+	for (i = 0; i < QUEUE_COUNT; ++i) {
+		if (strcmp(queues[i].name, name) == 0) {
+			return &queues[i];
+		}
+	}
+	return NULL;
+}
+
+
+/* current time on CLOCK_MONOTONIC */
+nsec_t monotonic_now(void)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+		errno_abort("Get monotonic time");
+	}
+	return now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+/* init shards, and their condition variables to wait on CLOCK_MONOTONIC */
+void create_shards(int count)
+{
+	int status, i;
+	pthread_condattr_t cond_attr;
+
+	shards = calloc(count, sizeof(shard_t));
+	if (shards == NULL) {
+		errno_abort("Allocate memory for shards");
+	}
+	shard_count = count;
+
+	// timed wait on CLOCK_MONOTONIC, so setting the wall clock does not move alarms
+	status = pthread_condattr_init(&cond_attr);
+	if (status != 0) {
+		err_abort(status, "Init cond attr");
+	}
+	status = pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	if (status != 0) {
+		err_abort(status, "Set cond clock");
+	}
+
+	for (i = 0; i < count; ++i) {
+		shards[i].index = i;
+		shards[i].next_id = 1;
+		status = pthread_mutex_init(&shards[i].mutex, NULL);
+		if (status != 0) {
+			err_abort(status, "Init shard mutex");
+		}
+		status = pthread_cond_init(&shards[i].cond, &cond_attr);
+		if (status != 0) {
+			err_abort(status, "Init shard cond");
+		}
+		queue->init(&shards[i], monotonic_now());
+	}
+
+	status = pthread_condattr_destroy(&cond_attr);
+	if (status != 0) {
+		err_abort(status, "Destroy cond attr");
+	}
+
+	status = pthread_key_create(&shard_key, NULL);
+	if (status != 0) {
+		err_abort(status, "Create shard key");
+	}
+}
+
+/* shard the calling thread inserts alarms into */
+shard_t *producer_shard(void)
+{
+	int status;
+	shard_t *shard = pthread_getspecific(shard_key);
+
+	if (shard == NULL) {
+		status = pthread_mutex_lock(&shard_next_mutex);
+		if (status != 0) {
+			err_abort(status, "Lock shard next mutex");
+		}
+		shard = &shards[shard_next++ % shard_count];
+		status = pthread_mutex_unlock(&shard_next_mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock shard next mutex");
+		}
+
+		status = pthread_setspecific(shard_key, shard);
+		if (status != 0) {
+			err_abort(status, "Set shard key");
+		}
+	}
+	return shard;
+}
+
+/* shard holding the alarm of a handle */
+shard_t *handle_shard(unsigned long id)
+{
+	return &shards[id % shard_count];
+}
+
+/* return the link pointing to alarm id in its hash bucket, or to the NULL at bucket end */
+alarm_t **hash_find(shard_t *shard, unsigned long id)
+{
+	static alarm_t *empty = NULL;
+	alarm_t **link;
+
+	if (shard->hash_size == 0) {
+		return &empty;
+	}
+	link = &shard->hash[(id / shard_count) & (shard->hash_size - 1)];
+	while (*link != NULL && (*link)->id != id) {
+		link = &(*link)->hash_link;
+	}
+	return link;
+}
+
+void hash_insert(shard_t *shard, alarm_t *alarm)
+{
+	size_t i, old_size = shard->hash_size;
+	alarm_t **old_hash = shard->hash, *next, **bucket;
+
+	/* keep load factor under 1, ids are sequential so low bits spread well */
+	if (shard->alarm_count >= shard->hash_size) {
+		shard->hash_size = shard->hash_size == 0 ? 64 : shard->hash_size * 2;
+		shard->hash = calloc(shard->hash_size, sizeof(alarm_t *));
+		if (shard->hash == NULL) {
+			errno_abort("Allocate memory for alarm hash");
+		}
+		for (i = 0; i < old_size; ++i) {
+			for (; old_hash[i] != NULL; old_hash[i] = next) {
+				next = old_hash[i]->hash_link;
+				bucket = &shard->hash[(old_hash[i]->id / shard_count) & (shard->hash_size - 1)];
+				old_hash[i]->hash_link = *bucket;
+				*bucket = old_hash[i];
+			}
+		}
+		free(old_hash);
+	}
+
+	bucket = &shard->hash[(alarm->id / shard_count) & (shard->hash_size - 1)];
+	alarm->hash_link = *bucket;
+	*bucket = alarm;
+	++shard->alarm_count;
+}
+
+void hash_remove(shard_t *shard, alarm_t *alarm)
+{
+	*hash_find(shard, alarm->id) = alarm->hash_link;
+	--shard->alarm_count;
+}
+
+/* wake up alarm thread if alarm is earlier than the one it waits for */
+void signal_alarm(shard_t *shard, nsec_t time)
+{
+	int status;
+
+	/* emtpy queue or insert a new earlier alarm */
+	if (shard->current_time == 0 || shard->current_time > time) {
+		shard->current_time = time;
+		status = pthread_cond_signal(&shard->cond);
+		if (status != 0) {
+			err_abort(status, "Signal alarm cond");
+		}
+	}
+}
+
+/* add alarm to queue and assign its handle, caller MUST have shard mutex locked */
+unsigned long add_alarm(shard_t *shard, alarm_t *alarm)
+{
+	alarm->id = shard->next_id++ * shard_count + shard->index;
+	hash_insert(shard, alarm);
+	queue->insert(shard, alarm);
+	return alarm->id;
+}
+
+/* remove and free a pending alarm, caller MUST have shard mutex locked */
+int cancel_alarm(shard_t *shard, unsigned long id)
+{
+	alarm_t *alarm = *hash_find(shard, id);
+
+	if (alarm == NULL) {
+		return ENOENT;
+	}
+	hash_remove(shard, alarm);
+	queue->remove(shard, alarm);
+	pool_free(&alarm_pool, alarm);
+	return 0;
+}
+
+/* return pending alarm by handle or NULL, caller MUST have shard mutex locked */
+alarm_t *find_alarm(shard_t *shard, unsigned long id)
+{
+	return *hash_find(shard, id);
+}
 
+/* move a pending alarm to a new expiration time, caller MUST have shard mutex locked */
+void move_alarm(shard_t *shard, alarm_t *alarm, nsec_t time)
+{
+	queue->remove(shard, alarm);
+	alarm->time = time;
+	queue->insert(shard, alarm);
+}
 
-alarm_t *alarm_list = NULL;
+/* insert alarm in queue and return its handle, caller MUST have shard mutex locked */
+unsigned long insert_alarm(shard_t *shard, alarm_t *alarm)
+{
+	add_alarm(shard, alarm);
+	signal_alarm(shard, alarm->time);
+	return alarm->id;
+}
 
-/* optimization for signal, only list is empty or insert a new earlier alarm */
-time_t current_time = 0;
+/* seconds converts to nsec_t, false for NaN too, as comparisons with it are */
+int valid_seconds(double seconds)
+{
+	return seconds >= 0 && seconds <= MAX_SECONDS;
+}
 
-/* main thread set alarm done flag when exit
- * alarm thread should exit when alarm list is empty and alarm done flag is set */
-int alarm_done = 0;
+/* expire pending alarm seconds from now, seconds MUST be valid_seconds, caller MUST have shard mutex locked */
+int reschedule_alarm(shard_t *shard, unsigned long id, double seconds)
+{
+	alarm_t *alarm = find_alarm(shard, id);
 
+	if (alarm == NULL) {
+		return ENOENT;
+	}
+	alarm->seconds = seconds;
+	move_alarm(shard, alarm, monotonic_now() + (nsec_t)(seconds * NSEC_PER_SEC));
+	signal_alarm(shard, alarm->time);
+	return 0;
+}
 
+/* default alarm action */
+void print_alarm(alarm_t *alarm, nsec_t late)
+{
+	printf("(%g) %s, late %.3f ms\n", alarm->seconds, alarm->message, late / 1e6);
+}
 
-/* insert alarm in list in order, caller MUST have alarm_metux locked */
-void insert_alarm(alarm_t *alarm)
+/* hand off a list of expired alarms to the workers */
+void dispatch_alarms(alarm_t *first, alarm_t *last, int count)
 {
 	int status;
-	alarm_t **last = &alarm_list;
-	alarm_t *next = alarm_list;
 
-	//DPRINTF(("insert alarm %ld(%d) %s\n", alarm->time, alarm->seconds, alarm->message));
+	status = pthread_mutex_lock(&dispatch.mutex);
+	if (status != 0) {
+		err_abort(status, "Lock dispatch mutex");
+	}
+
+	if (dispatch.first == NULL) {
+		dispatch.first = first;
+	} else {
+		dispatch.last->link = first;
+	}
+	dispatch.last = last;
+
+	if (count > 1) {
+		status = pthread_cond_broadcast(&dispatch.avail);
+	} else {
+		status = pthread_cond_signal(&dispatch.avail);
+	}
+	if (status != 0) {
+		err_abort(status, "Signal dispatch avail");
+	}
+
+	status = pthread_mutex_unlock(&dispatch.mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock dispatch mutex");
+	}
+}
+
+/* worker thread start function, run actions of expired alarms */
+void *worker_thread(void *arg)
+{
+	int status, bucket;
+	worker_t *worker = (worker_t *)arg;
+	alarm_t *alarm;
+	nsec_t late;
+
+	while (1) {
+		status = pthread_mutex_lock(&dispatch.mutex);
+		if (status != 0) {
+			err_abort(status, "Lock dispatch mutex");
+		}
+
+		while (dispatch.first == NULL && !dispatch.done) {
+			status = pthread_cond_wait(&dispatch.avail, &dispatch.mutex);
+			if (status != 0) {
+				err_abort(status, "Wait on dispatch avail");
+			}
+		}
+
+		alarm = dispatch.first;
+		if (alarm != NULL) {
+			dispatch.first = alarm->link;
+		}
+
+		status = pthread_mutex_unlock(&dispatch.mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock dispatch mutex");
+		}
 
-	while (next != NULL) {
-		if (next->time > alarm->time) {
-			*last = alarm;
-			alarm->link = next;
+		// dispatch is done and drained
+		if (alarm == NULL) {
 			break;
 		}
-		last = &next->link;
-		next = next->link;
+
+		late = monotonic_now() - alarm->time;
+		for (bucket = 0; bucket < LATE_BUCKETS - 1 && late >= 1000LL << bucket; ++bucket) {
+			;
+		}
+		++worker->histogram[bucket];
+		++worker->fired;
+		worker->late_total += late;
+		if (late > worker->late_max) {
+			worker->late_max = late;
+		}
+
+		alarm->action(alarm, late);
+		pool_free(&alarm_pool, alarm);
 	}
+	return NULL;
+}
+
+/* stop and join workers after the last dispatch, then report lateness */
+void stop_workers(void)
+{
+	int status, i, bucket;
+	long fired = 0, histogram[LATE_BUCKETS] = {0};
+	nsec_t late_total = 0, late_max = 0;
 
-	/* empty list or insert at list tail */
-	if (next == NULL) {
-		*last = alarm;
-		alarm->link = NULL;
+	status = pthread_mutex_lock(&dispatch.mutex);
+	if (status != 0) {
+		err_abort(status, "Lock dispatch mutex");
+	}
+	dispatch.done = 1;
+	status = pthread_cond_broadcast(&dispatch.avail);
+	if (status != 0) {
+		err_abort(status, "Broadcast dispatch done");
 	}
-#ifdef DEBUG
-	printf("[list\n");
-	for (next = alarm_list; next != NULL; next = next->link) {
-		printf("%ld(%d) %s\n", next->time, next->seconds, next->message);
+	status = pthread_mutex_unlock(&dispatch.mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock dispatch mutex");
 	}
-	printf("]\n");
-#endif
-	/* emtpy list or insert a new earlier alarm */
-	if (current_time == 0 || current_time > alarm->time) {
-		//DPRINTF(("signal alarm_thread, current_time %ld, alarm->time %ld\n", current_time, alarm->time));
-		current_time = alarm->time;
-		status = pthread_cond_signal(&alarm_cond);
+
+	for (i = 0; i < worker_count; ++i) {
+		status = pthread_join(workers[i].thread, NULL);
 		if (status != 0) {
-			err_abort(status, "Signal alarm cond");
+			err_abort(status, "Join worker");
+		}
+		fired += workers[i].fired;
+		late_total += workers[i].late_total;
+		if (workers[i].late_max > late_max) {
+			late_max = workers[i].late_max;
+		}
+		for (bucket = 0; bucket < LATE_BUCKETS; ++bucket) {
+			histogram[bucket] += workers[i].histogram[bucket];
+		}
+	}
+
+	if (fired == 0) {
+		return;
+	}
+	printf("%ld alarms, lateness avg %.3f ms, max %.3f ms\n", fired, late_total / 1e6 / fired, late_max / 1e6);
+	for (bucket = 0; bucket < LATE_BUCKETS; ++bucket) {
+		if (histogram[bucket] != 0) {
+			printf("  < %8lld us: %ld\n", 1LL << bucket, histogram[bucket]);
 		}
 	}
 }
 
-/* alarm thread start function */
-void *alarm_thread(void *arg)
+/* print alarm thread counters summed over shards */
+void print_stats(void)
 {
-	int status;
-	int expired;
-	time_t now;
-	alarm_t *alarm;
+	int status, i;
+	stats_t stats;
 
-	while(1) {
-		status = pthread_mutex_lock(&alarm_mutex);
+	memset(&stats, 0, sizeof(stats));
+	for (i = 0; i < shard_count; ++i) {
+		status = pthread_mutex_lock(&shards[i].mutex);
 		if (status != 0) {
-			err_abort(status, "Lock mutex");
+			err_abort(status, "Lock shard mutex");
+		}
+		stats.wakeups += shards[i].stats.wakeups;
+		stats.timeouts += shards[i].stats.timeouts;
+		stats.preempted += shards[i].stats.preempted;
+		stats.spurious += shards[i].stats.spurious;
+		stats.batches += shards[i].stats.batches;
+		stats.expired += shards[i].stats.expired;
+		if (shards[i].stats.max_batch > stats.max_batch) {
+			stats.max_batch = shards[i].stats.max_batch;
+		}
+		status = pthread_mutex_unlock(&shards[i].mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock shard mutex");
 		}
+	}
+
+	printf("%d shards, wakeups %ld (timeout %ld, preempted %ld, spurious %ld), "
+			"expired %ld in %ld batches (%.2f per wakeup, max %ld)\n",
+			shard_count, stats.wakeups, stats.timeouts, stats.preempted, stats.spurious,
+			stats.expired, stats.batches,
+			stats.wakeups == 0 ? 0.0 : (double)stats.expired / stats.wakeups,
+			stats.max_batch);
+	pool_stats(&alarm_pool);
+}
+
+/*
+ * alarm thread start function of a shard, wait for the earliest alarm,
+ * then detach all expired alarms in one critical section and hand them
+ * off to workers
+ */
+void *alarm_thread(void *arg)
+{
+	int status, count;
+	shard_t *shard = (shard_t *)arg;
+	stats_t *stats = &shard->stats;
+	nsec_t next;
+	alarm_t *first, *last, *alarm;
+	struct timespec timeout;
+
+	status = pthread_mutex_lock(&shard->mutex);
+	if (status != 0) {
+		err_abort(status, "Lock mutex");
+	}
 
-		current_time = 0;
-		while (alarm_list == NULL) {
-			if (alarm_done) {
-				status = pthread_mutex_unlock(&alarm_mutex);
+	while(1) {
+		shard->current_time = 0;
+		while (!queue->next_time(shard, &next)) {
+			if (shard->done) {
+				status = pthread_mutex_unlock(&shard->mutex);
 				if (status != 0) {
 					err_abort(status, "Unlock mutex");
 				}
-				pthread_exit(0);
+				return NULL;
 			}
-			//DPRINTF(("wait on empty list\n"));
-			status = pthread_cond_wait(&alarm_cond, &alarm_mutex);
+			status = pthread_cond_wait(&shard->cond, &shard->mutex);
 			if (status != 0) {
-				err_abort(status, "Wait on empty list");
+				err_abort(status, "Wait on empty queue");
+			}
+			++stats->wakeups;
+			if (!queue->next_time(shard, &next) && !shard->done) {
+				++stats->spurious;
 			}
 		}
 
-		expired = 0;
-		alarm = alarm_list;
-		alarm_list = alarm->link;
-		now = time(NULL);
-
-		if (alarm->time > now) {
-			struct timespec timeout;
-			timeout.tv_sec = alarm->time;
-			timeout.tv_nsec = 0;
-			current_time = alarm->time;
-			while (current_time == alarm->time) {
-				//DPRINTF(("wait on alarm %ld(%d) %s\n", alarm->time, alarm->seconds, alarm->message));
-				status = pthread_cond_timedwait(&alarm_cond, &alarm_mutex, &timeout);
-				if (status != 0) {
-					if (status == ETIMEDOUT) {
-						//DPRINTF(("alarm expired by time out\n"));
-						expired = 1;
-						break;
-					} else {
-						err_abort(status, "Timed wait on alarm");
-					}
-				}
+		count = queue->expire(shard, monotonic_now(), &first, &last);
+		if (count == 0) {
+			// wait until the earliest alarm expires or a new earlier alarm is inserted,
+			// the alarm stays in queue, so no reinsert is needed after signaled
+			timeout.tv_sec = next / NSEC_PER_SEC;
+			timeout.tv_nsec = next % NSEC_PER_SEC;
+			shard->current_time = next;
+			status = pthread_cond_timedwait(&shard->cond, &shard->mutex, &timeout);
+			if (status != 0 && status != ETIMEDOUT) {
+				err_abort(status, "Timed wait on alarm");
 			}
-
-			// signal by new earlier alarm, so reinsert current unexpired alarm
-			if (!expired) {
-				//DPRINTF(("reinsert alarm %ld(%d) %s\n", alarm->time, alarm->seconds, alarm->message));
-				insert_alarm(alarm);
+			++stats->wakeups;
+			if (status == ETIMEDOUT) {
+				++stats->timeouts;
+			} else if (shard->current_time < next) {
+				++stats->preempted;
+			} else if (!shard->done) {
+				++stats->spurious;
 			}
-		} else {
-			//DPRINTF(("alarm already expired\n"));
-			expired = 1;
+			continue;
+		}
+
+		// expired alarms can't be canceled any more
+		for (alarm = first; alarm != NULL; alarm = alarm->link) {
+			hash_remove(shard, alarm);
 		}
 
-		status = pthread_mutex_unlock(&alarm_mutex);
+		++stats->batches;
+		stats->expired += count;
+		if (count > stats->max_batch) {
+			stats->max_batch = count;
+		}
+
+		status = pthread_mutex_unlock(&shard->mutex);
 		if (status != 0) {
 			err_abort(status, "Unlock mutex");
 		}
 
-		if (expired) {
-			printf("(%d) %s\n", alarm->seconds, alarm->message);
-			free(alarm);
+		dispatch_alarms(first, last, count);
+
+		status = pthread_mutex_lock(&shard->mutex);
+		if (status != 0) {
+			err_abort(status, "Lock mutex");
 		}
 	}
 	return NULL;
 }
 
-int main()
+/* start an alarm thread for each of the shard_count shards */
+void start_alarm_threads(void)
 {
-	int status;
-	pthread_t alarm_thread_id;
-	char line[128];
+	int status, i;
+
+	for (i = 0; i < shard_count; ++i) {
+		shards[i].done = 0;
+		status = pthread_create(&shards[i].thread, NULL, alarm_thread, &shards[i]);
+		if (status != 0) {
+			err_abort(status, "Create alarm thread");
+		}
+	}
+}
+
+/* let alarm threads drain their queues and exit, shard_count MUST not change until they are joined */
+void stop_alarm_threads(void)
+{
+	int status, i;
+
+	for (i = 0; i < shard_count; ++i) {
+		status = pthread_mutex_lock(&shards[i].mutex);
+		if (status != 0) {
+			err_abort(status, "Lock alarm mutex");
+		}
+		shards[i].done = 1;
+		status = pthread_cond_signal(&shards[i].cond);
+		if (status != 0) {
+			err_abort(status, "Signal alarm cond");
+		}
+		status = pthread_mutex_unlock(&shards[i].mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock alarm mutex");
+		}
+	}
+	for (i = 0; i < shard_count; ++i) {
+		status = pthread_join(shards[i].thread, NULL);
+		if (status != 0) {
+			err_abort(status, "Join alarm thread");
+		}
+	}
+}
+
+/* free all alarms left in a shard */
+void drain_shard(shard_t *shard)
+{
+	alarm_t *first, *last, *alarm;
+
+	queue->expire(shard, LLONG_MAX, &first, &last);
+	while (first != NULL) {
+		alarm = first;
+		first = alarm->link;
+		hash_remove(shard, alarm);
+		pool_free(&alarm_pool, alarm);
+	}
+}
+
+double elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Insert count alarms spread over one day with millisecond resolution into
+ * each backend, then drain them in expiration order. The sorted list is
+ * quadratic, so it's skipped for more than 10000 alarms.
+ */
+void benchmark(int count)
+{
+	int i, popped;
+	shard_t *shard = &shards[0];
+	nsec_t base = monotonic_now(), next, last;
+	alarm_t *alarms, *alarm;
+	struct timespec start;
+	double insert_time, drain_time;
+
+	alarms = malloc(count * sizeof(alarm_t));
+	if (alarms == NULL) {
+		errno_abort("Allocate memory for benchmark alarms");
+	}
+
+	for (queue = queues; queue < queues + QUEUE_COUNT; ++queue) {
+		if (queue == &queues[0] && count > 10000) {
+			printf("%-6s %8d alarms: skipped\n", queue->name, count);
+			continue;
+		}
+
+		srand(count);
+		queue->init(shard, base);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; ++i) {
+			alarms[i].time = base + rand() % (24 * 60 * 60 * 1000) * 1000000LL;
+			queue->insert(shard, &alarms[i]);
+		}
+		insert_time = elapsed(&start);
+
+		popped = 0;
+		last = base;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (queue->next_time(shard, &next)) {
+			while ((alarm = queue->pop_expired(shard, next)) != NULL) {
+				if (alarm->time < last) {
+					fprintf(stderr, "%s: alarm %lld popped after %lld\n", queue->name, alarm->time, last);
+				}
+				last = alarm->time;
+				++popped;
+			}
+		}
+		drain_time = elapsed(&start);
+
+		printf("%-6s %8d alarms: insert %.3fs (%.0f ns/op), drain %.3fs (%.0f ns/op)%s\n",
+				queue->name, count,
+				insert_time, insert_time * 1e9 / count,
+				drain_time, drain_time * 1e9 / count,
+				popped == count ? "" : ", LOST ALARMS");
+	}
+
+	free(alarms);
+}
+
+/*
+ * Keep count alarms pending, then cancel a random one and insert a new one
+ * count times, and reschedule a random one count times.
+ */
+void churn_benchmark(int count)
+{
+	int i, j;
+	shard_t *shard = &shards[0];
+	nsec_t base = monotonic_now();
+	unsigned long *live;
 	alarm_t *alarm;
+	struct timespec start;
+	double cancel_time, reschedule_time;
 
-	status = pthread_create(&alarm_thread_id, NULL, alarm_thread, NULL);
-	if (status != 0) {
-		err_abort(status, "Create alarm thread");
+	live = malloc(count * sizeof(unsigned long));
+	if (live == NULL) {
+		errno_abort("Allocate memory for benchmark handles");
 	}
 
-	while(1) {
-		printf("Alarm>\n");
+	for (queue = queues; queue < queues + QUEUE_COUNT; ++queue) {
+		if (queue == &queues[0] && count > 10000) {
+			printf("%-6s %8d alarms: skipped\n", queue->name, count);
+			continue;
+		}
 
-		if (fgets(line, sizeof(line), stdin) == NULL) {
-			status = pthread_mutex_lock(&alarm_mutex);
-			if (status != 0) {
-				err_abort(status, "Lock alarm mutex");
+		srand(count);
+		queue->init(shard, base);
+		for (i = 0; i < count; ++i) {
+			alarm = pool_alloc(&alarm_pool);
+			if (alarm == NULL) {
+				errno_abort("Allocate memory for alarm");
+			}
+			alarm->time = base + rand() % (24 * 60 * 60 * 1000) * 1000000LL;
+			live[i] = add_alarm(shard, alarm);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; ++i) {
+			j = rand() % count;
+			if (cancel_alarm(shard, live[j]) != 0) {
+				fprintf(stderr, "%s: alarm %lu lost\n", queue->name, live[j]);
 			}
+			alarm = pool_alloc(&alarm_pool);
+			if (alarm == NULL) {
+				errno_abort("Allocate memory for alarm");
+			}
+			alarm->time = base + rand() % (24 * 60 * 60 * 1000) * 1000000LL;
+			live[j] = add_alarm(shard, alarm);
+		}
+		cancel_time = elapsed(&start);
 
-			alarm_done = 1;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < count; ++i) {
+			alarm = find_alarm(shard, live[rand() % count]);
+			move_alarm(shard, alarm, base + rand() % (24 * 60 * 60 * 1000) * 1000000LL);
+		}
+		reschedule_time = elapsed(&start);
 
-			status = pthread_cond_signal(&alarm_cond);
-			if (status != 0) {
-				err_abort(status, "Unlock alarm mutex");
+		i = shard->alarm_count;
+		drain_shard(shard);
+
+		printf("%-6s %8d alarms: cancel+insert %.0f ns/op, reschedule %.0f ns/op%s\n",
+				queue->name, count,
+				cancel_time * 1e9 / count, reschedule_time * 1e9 / count,
+				i == count && shard->alarm_count == 0 ? "" : ", LOST ALARMS");
+	}
+
+	free(live);
+	pool_stats(&alarm_pool);
+}
+
+/* producer thread of scaling benchmark, insert alarms far in the future */
+void *producer_thread(void *arg)
+{
+	int status, i, count = *(int *)arg;
+	unsigned int seed = (unsigned int)(size_t)pthread_self();
+	nsec_t base = monotonic_now() + 24 * 60 * 60 * NSEC_PER_SEC;
+	shard_t *shard = producer_shard();
+	alarm_t *alarm;
+
+	for (i = 0; i < count; ++i) {
+		alarm = pool_alloc(&alarm_pool);
+		if (alarm == NULL) {
+			errno_abort("Allocate memory for alarm");
+		}
+		alarm->time = base + rand_r(&seed) % (60 * 60 * 1000) * 1000000LL;
+		alarm->seconds = 0;
+		alarm->message[0] = '\0';
+		alarm->action = print_alarm;
+
+		status = pthread_mutex_lock(&shard->mutex);
+		if (status != 0) {
+			err_abort(status, "Lock shard mutex");
+		}
+		insert_alarm(shard, alarm);
+		status = pthread_mutex_unlock(&shard->mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock shard mutex");
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Insert count alarms from 1 to 64 producer threads, once into a single
+ * shard and once into all shards, while the alarm threads wait. Alarm
+ * threads map handles to shards with shard_count, so they are started
+ * for each setting of it and joined before it changes.
+ */
+void scaling_benchmark(int count)
+{
+	int status, i, producers, per_producer, shards_used, config;
+	int max_shards = shard_count;
+	pthread_t threads[64];
+	struct timespec start;
+	double insert_time;
+
+	for (config = 0; config < 2; ++config) {
+		shards_used = config == 0 ? 1 : max_shards;
+		if (config == 1 && max_shards == 1) {
+			break;
+		}
+		shard_count = shards_used;
+		start_alarm_threads();
+		for (producers = 1; producers <= 64; producers *= 2) {
+			shard_next = 0;
+			per_producer = count / producers;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (i = 0; i < producers; ++i) {
+				status = pthread_create(&threads[i], NULL, producer_thread, &per_producer);
+				if (status != 0) {
+					err_abort(status, "Create producer thread");
+				}
+			}
+			for (i = 0; i < producers; ++i) {
+				status = pthread_join(threads[i], NULL);
+				if (status != 0) {
+					err_abort(status, "Join producer thread");
+				}
 			}
+			insert_time = elapsed(&start);
 
-			status = pthread_mutex_unlock(&alarm_mutex);
-			if (status != 0) {
-				err_abort(status, "Unlock alarm mutex");
+			printf("%-6s %2d shards %2d producers: %8.0f inserts/s\n",
+					queue->name, shards_used, producers, per_producer * producers / insert_time);
+
+			for (i = 0; i < shards_used; ++i) {
+				status = pthread_mutex_lock(&shards[i].mutex);
+				if (status != 0) {
+					err_abort(status, "Lock shard mutex");
+				}
+				drain_shard(&shards[i]);
+				status = pthread_mutex_unlock(&shards[i].mutex);
+				if (status != 0) {
+					err_abort(status, "Unlock shard mutex");
+				}
+			}
+		}
+		stop_alarm_threads();
+	}
+	shard_count = max_shards;
+	pool_stats(&alarm_pool);
+}
+
+int main(int argc, char **argv)
+{
+	int status, i, count = 0, bench = 0;
+	char line[128], *end;
+	char message[64 + 1];
+	unsigned long id;
+	double seconds;
+	shard_t *shard;
+	alarm_t *alarm;
+
+	shard_count = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			worker_count = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			shard_count = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "-p") == 0) {
+			bench = argv[i][1];
+			// the count is optional, another option may follow instead
+			if (i + 1 < argc && argv[i + 1][0] != '-') {
+				count = strtol(argv[++i], &end, 10);
+				if (*end != '\0' || count < 1) {
+					count = -1;
+				}
 			}
-			pthread_exit(0);
+		} else {
+			queue = find_queue(argv[i]);
+		}
+		if (queue == NULL || worker_count < 1 || shard_count < 1 || count < 0) {
+			fprintf(stderr, "%s [-w workers] [-s shards] [list|heap|wheel]\n"
+					"%s -b [count]\n"
+					"%s [-s shards] [list|heap|wheel] -p [count]\n", argv[0], argv[0], argv[0]);
+			return -1;
+		}
+	}
+
+	status = pool_init(&alarm_pool, "alarm_t", sizeof(alarm_t));
+	if (status != 0) {
+		err_abort(status, "Init alarm pool");
+	}
+
+	if (bench == 'b') {
+		create_shards(1);
+		if (count > 0) {
+			benchmark(count);
+			churn_benchmark(count);
+		} else {
+			benchmark(1000);
+			benchmark(100000);
+			benchmark(1000000);
+			churn_benchmark(1000);
+			churn_benchmark(100000);
+			churn_benchmark(1000000);
+		}
+		return 0;
+	}
+
+	create_shards(shard_count);
+	if (bench == 'p') {
+		scaling_benchmark(count > 0 ? count : 1000000);
+		return 0;
+	}
+	start_alarm_threads();
+
+	workers = calloc(worker_count, sizeof(worker_t));
+	if (workers == NULL) {
+		errno_abort("Allocate memory for workers");
+	}
+	for (i = 0; i < worker_count; ++i) {
+		workers[i].index = i;
+		status = pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+		if (status != 0) {
+			err_abort(status, "Create worker thread");
+		}
+	}
+
+	while(1) {
+		printf("Alarm>\n");
+
+		if (fgets(line, sizeof(line), stdin) == NULL) {
+			break;
 		}
 
 		if (strlen(line) < 1) {
 			continue;
 		}
 
-		alarm = malloc(sizeof(alarm_t));
-		if (alarm == NULL) {
-			errno_abort("Allocate memory for alarm");
+		if (strcmp(line, "=\n") == 0) {
+			print_stats();
+			continue;
 		}
 
-		if (sscanf(line, "%d %64[^\n]", &alarm->seconds, alarm->message) < 2) {
-			fprintf(stderr, "Bad command");
-			free(alarm);
+		if (sscanf(line, "cancel %lu", &id) == 1
+				|| sscanf(line, "reschedule %lu %lf", &id, &seconds) == 2) {
+			shard = handle_shard(id);
 		} else {
-			status = pthread_mutex_lock(&alarm_mutex);
-			if (status != 0) {
-				err_abort(status, "Lock mutex");
+			shard = producer_shard();
+		}
+
+		status = pthread_mutex_lock(&shard->mutex);
+		if (status != 0) {
+			err_abort(status, "Lock mutex");
+		}
+
+		if (sscanf(line, "cancel %lu", &id) == 1) {
+			if (cancel_alarm(shard, id) != 0) {
+				fprintf(stderr, "No pending alarm %lu\n", id);
+			}
+		} else if (sscanf(line, "reschedule %lu %lf", &id, &seconds) == 2) {
+			if (!valid_seconds(seconds)) {
+				fprintf(stderr, "Bad seconds, from 0 to %d\n", MAX_SECONDS);
+			} else if (reschedule_alarm(shard, id, seconds) != 0) {
+				fprintf(stderr, "No pending alarm %lu\n", id);
+			}
+		// seconds may be fractional, e.g. "0.25 message"
+		} else if (sscanf(line, "%lf %64[^\n]", &seconds, message) < 2) {
+			fprintf(stderr, "Bad command\n");
+		} else if (!valid_seconds(seconds)) {
+			fprintf(stderr, "Bad seconds, from 0 to %d\n", MAX_SECONDS);
+		} else {
+			alarm = pool_alloc(&alarm_pool);
+			if (alarm == NULL) {
+				errno_abort("Allocate memory for alarm");
 			}
 
-			alarm->time = time(NULL) + alarm->seconds;
+			alarm->seconds = seconds;
+			strcpy(alarm->message, message);
+			alarm->time = monotonic_now() + (nsec_t)(seconds * NSEC_PER_SEC);
 			alarm->link = NULL;
+			alarm->action = print_alarm;
 
-			insert_alarm(alarm);
+			printf("Alarm %lu\n", insert_alarm(shard, alarm));
+			DPRINTF(("insert alarm %lu %lld(%g) %s into %s %d\n", alarm->id, alarm->time, alarm->seconds, alarm->message, queue->name, shard->index));
+		}
 
-			status = pthread_mutex_unlock(&alarm_mutex);
-			if (status != 0) {
-				err_abort(status, "Unlock mutex");
-			}
+		status = pthread_mutex_unlock(&shard->mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock mutex");
 		}
 	}
+
+	// let alarm threads drain their queues, then the workers
+	stop_alarm_threads();
+	stop_workers();
+	print_stats();
 	return 0;
 }
@@ -1,9 +1,18 @@
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/timerfd.h>
 #include "errors.h"
 
 typedef struct alarm_type {
 	// point to next alarm request
 	struct alarm_type		*link;
+	// point to the link pointing to this alarm in alarm_list
+	struct alarm_type		**pprev;
+	// next alarm in the same handle hash bucket
+	struct alarm_type		*hash_link;
+	// alarm handle
+	unsigned long			id;
 	// expiration time for this alarm
 	time_t				time;
 	// requested seconds
@@ -14,13 +23,172 @@ typedef struct alarm_type {
 
 pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
 alarm_t *alarm_list = NULL;
+// armed for expiration time of the head of alarm_list, disarmed when list is empty,
+// alarm thread blocks in read on it, so it only wakes up when an alarm is due
+int alarm_timer = -1;
 
+// alarm thread counters for self test, protected by alarm_mutex
+long wakeups = 0;
+long fired = 0;
+double last_late = 0;
+
+// alarm handles hashed by id, protected by alarm_mutex
+alarm_t **alarm_hash = NULL;
+size_t hash_size = 0;
+size_t alarm_count = 0;
+unsigned long next_id = 1;
+
+
+// return the link pointing to alarm id in its hash bucket, or to the NULL at bucket end
+alarm_t **hash_find(unsigned long id)
+{
+	static alarm_t *empty = NULL;
+	alarm_t **link;
+
+	if (hash_size == 0) {
+		return &empty;
+	}
+	link = &alarm_hash[id & (hash_size - 1)];
+	while (*link != NULL && (*link)->id != id) {
+		link = &(*link)->hash_link;
+	}
+	return link;
+}
+
+void hash_insert(alarm_t *alarm)
+{
+	size_t i, old_size = hash_size;
+	alarm_t **old_hash = alarm_hash, *next, **bucket;
+
+	// keep load factor under 1, ids are sequential so low bits spread well
+	if (alarm_count >= hash_size) {
+		hash_size = hash_size == 0 ? 64 : hash_size * 2;
+		alarm_hash = calloc(hash_size, sizeof(alarm_t *));
+		if (alarm_hash == NULL) {
+			errno_abort("Allocate alarm hash");
+		}
+		for (i = 0; i < old_size; ++i) {
+			for (; old_hash[i] != NULL; old_hash[i] = next) {
+				next = old_hash[i]->hash_link;
+				bucket = &alarm_hash[old_hash[i]->id & (hash_size - 1)];
+				old_hash[i]->hash_link = *bucket;
+				*bucket = old_hash[i];
+			}
+		}
+		free(old_hash);
+	}
+
+	bucket = &alarm_hash[alarm->id & (hash_size - 1)];
+	alarm->hash_link = *bucket;
+	*bucket = alarm;
+	++alarm_count;
+}
+
+void hash_remove(alarm_t *alarm)
+{
+	*hash_find(alarm->id) = alarm->hash_link;
+	--alarm_count;
+}
+
+// insert alarm into alarm_list sorted by expiration time, caller MUST have alarm_mutex locked
+void list_insert(alarm_t *alarm)
+{
+	// last point to head or previous alarm's link member
+	alarm_t **last = &alarm_list;
+
+	while (*last != NULL && (*last)->time <= alarm->time) {
+		last = &(*last)->link;
+	}
+
+	alarm->link = *last;
+	if (*last != NULL) {
+		(*last)->pprev = &alarm->link;
+	}
+	alarm->pprev = last;
+	*last = alarm;
+#ifdef DEBUG
+	alarm_t *next;
+	printf("[list:\n");
+	for (next = alarm_list; next != NULL; next = next->link) {
+		printf("%lu %ld(%ld)\"%s\"\n", next->id, next->time, next->time - time(NULL), next->message);
+	}
+	printf("]\n");
+#endif
+}
+
+// unlink alarm from alarm_list without walking it, caller MUST have alarm_mutex locked
+void list_remove(alarm_t *alarm)
+{
+	*alarm->pprev = alarm->link;
+	if (alarm->link != NULL) {
+		alarm->link->pprev = alarm->pprev;
+	}
+}
+
+// arm alarm_timer for the head of alarm_list, caller MUST have alarm_mutex locked
+void arm_timer(void)
+{
+	struct itimerspec value;
+
+	memset(&value, 0, sizeof(value));
+	if (alarm_list != NULL) {
+		value.it_value.tv_sec = alarm_list->time;
+	}
+	// a zero it_value disarms the timer, an expiration time in the past fires at once
+	if (timerfd_settime(alarm_timer, TFD_TIMER_ABSTIME, &value, NULL) != 0) {
+		errno_abort("Arm alarm timer");
+	}
+}
+
+// caller MUST have alarm_mutex locked
+int cancel_alarm(unsigned long id)
+{
+	alarm_t *alarm = *hash_find(id);
+
+	if (alarm == NULL) {
+		return ENOENT;
+	}
+	hash_remove(alarm);
+	list_remove(alarm);
+	free(alarm);
+	arm_timer();
+	return 0;
+}
+
+// caller MUST have alarm_mutex locked
+void insert_alarm(alarm_t *alarm)
+{
+	alarm->time = time(NULL) + alarm->seconds;
+	alarm->id = next_id++;
+	hash_insert(alarm);
+	list_insert(alarm);
+	// new earlier alarm, wake up alarm thread earlier
+	if (alarm_list == alarm) {
+		arm_timer();
+	}
+}
+
+// caller MUST have alarm_mutex locked
+int reschedule_alarm(unsigned long id, int seconds)
+{
+	alarm_t *alarm = *hash_find(id);
+
+	if (alarm == NULL) {
+		return ENOENT;
+	}
+	list_remove(alarm);
+	alarm->seconds = seconds;
+	alarm->time = time(NULL) + seconds;
+	list_insert(alarm);
+	arm_timer();
+	return 0;
+}
 
 void *alarm_thread(void *arg)
 {
-	int sleep_time;
 	alarm_t *alarm;
-	time_t now;
+	uint64_t expirations;
+	struct timespec now;
 	int status;
 
 	// alarm thread will evaporate after process exit
@@ -29,58 +197,145 @@ void *alarm_thread(void *arg)
 		if (status != 0) {
 			err_abort(status, "Lock alarm mutex");
 		}
-		alarm = alarm_list;
 
-		if (alarm == NULL) {
-			sleep_time = 1;
-		} else {
-			alarm_list = alarm->link;
-			now = time(NULL);
-			if (now == -1) {
-				errno_abort("Get time");
-			}
+		// fire all expired alarms, they stay on list until due so no one else has to track them
+		while (alarm_list != NULL && alarm_list->time <= time(NULL)) {
+			alarm = alarm_list;
+			list_remove(alarm);
+			hash_remove(alarm);
 
-			if (alarm->time <= now) {
-				sleep_time = 0;
-			} else {
-				sleep_time = alarm->time - now;
-			}
-#ifdef DEBUG
-			printf("%ld(%d) %s\n", alarm->time, sleep_time, alarm->message);
-#endif
+			clock_gettime(CLOCK_REALTIME, &now);
+			last_late = (now.tv_sec - alarm->time) + now.tv_nsec / 1e9;
+			++fired;
+			printf("(%d)->%s\n", alarm->seconds, alarm->message);
+			free(alarm);
 		}
+		arm_timer();
 
-		// release mutex before sleep for main thread to add new alarm request to alarm_list
+		// release mutex before wait for main thread to add new alarm request to alarm_list
 		status = pthread_mutex_unlock(&alarm_mutex);
 		if (status != 0) {
 			err_abort(status, "Unlock alarm mutex");
 		}
 
-		if (sleep_time > 0) {
-			sleep(sleep_time);
-		} else {
-			sched_yield();
+		// block until the head alarm expires, main thread rearms the timer for an earlier alarm
+		if (read(alarm_timer, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+			if (errno != EINTR) {
+				errno_abort("Read alarm timer");
+			}
 		}
 
-		if (alarm != NULL) {
-			printf("(%d)->%s\n", alarm->seconds, alarm->message);
-			free(alarm);
+		status = pthread_mutex_lock(&alarm_mutex);
+		if (status != 0) {
+			err_abort(status, "Lock alarm mutex");
+		}
+		++wakeups;
+		status = pthread_mutex_unlock(&alarm_mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock alarm mutex");
 		}
 	}
 }
 
-int main()
+// wait until count alarms are fired, or timeout seconds, return alarms fired
+long wait_fired(long count, int timeout)
+{
+	int status, i;
+	long result = 0;
+	struct timespec tick = {0, 10000000};
+
+	for (i = 0; i < timeout * 100; ++i) {
+		status = pthread_mutex_lock(&alarm_mutex);
+		if (status != 0) {
+			err_abort(status, "Lock alarm mutex");
+		}
+		result = fired;
+		status = pthread_mutex_unlock(&alarm_mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock alarm mutex");
+		}
+		if (result >= count) {
+			break;
+		}
+		nanosleep(&tick, NULL);
+	}
+	return result;
+}
+
+/*
+ * Self test: an idle alarm thread must not wake up, and an alarm inserted
+ * ahead of a far later one must fire on time instead of after it.
+ */
+int self_test(void)
+{
+	int status, failed = 0;
+	alarm_t *alarm;
+
+	sleep(3);
+	status = pthread_mutex_lock(&alarm_mutex);
+	if (status != 0) {
+		err_abort(status, "Lock alarm mutex");
+	}
+	printf("idle: %ld wakeups in 3 seconds\n", wakeups);
+	failed |= wakeups != 0;
+
+	alarm = malloc(sizeof(alarm_t));
+	if (alarm == NULL) {
+		errno_abort("Allocate alarm_t");
+	}
+	alarm->seconds = 60;
+	strcpy(alarm->message, "far");
+	insert_alarm(alarm);
+
+	alarm = malloc(sizeof(alarm_t));
+	if (alarm == NULL) {
+		errno_abort("Allocate alarm_t");
+	}
+	alarm->seconds = 1;
+	strcpy(alarm->message, "near");
+	insert_alarm(alarm);
+
+	status = pthread_mutex_unlock(&alarm_mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock alarm mutex");
+	}
+
+	if (wait_fired(1, 3) < 1) {
+		printf("earlier alarm: not fired within 3 seconds\n");
+		failed = 1;
+	} else {
+		printf("earlier alarm: fired %.3f seconds after its expiration time\n", last_late);
+		failed |= last_late > 0.5;
+	}
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+	return failed;
+}
+
+int main(int argc, char **argv)
 {
 	int status;
 	char line[128];
 	alarm_t *alarm;
 	pthread_t thread;
+	unsigned long id;
+	int seconds;
+
+	// CLOCK_REALTIME, as alarm times are from time()
+	alarm_timer = timerfd_create(CLOCK_REALTIME, 0);
+	if (alarm_timer == -1) {
+		errno_abort("Create alarm timer");
+	}
 
 	status = pthread_create(&thread, NULL, alarm_thread, NULL);
 	if (status != 0) {
 		err_abort(status, "Create alarm thread");
 	}
 
+	if (argc > 1 && strcmp(argv[1], "-t") == 0) {
+		return self_test();
+	}
+
 	while (1) {
 		printf("Alarm>\n");
 		if (fgets(line, sizeof(line), stdin) == NULL) {
@@ -91,6 +346,37 @@ int main()
 			continue;
 		}
 
+		// "cancel id" and "reschedule id seconds" take the handle printed on insert
+		if (sscanf(line, "cancel %lu", &id) == 1) {
+			status = pthread_mutex_lock(&alarm_mutex);
+			if (status != 0) {
+				err_abort(status, "Lock alarm mutex");
+			}
+			if (cancel_alarm(id) != 0) {
+				fprintf(stderr, "No pending alarm %lu\n", id);
+			}
+			status = pthread_mutex_unlock(&alarm_mutex);
+			if (status != 0) {
+				err_abort(status, "Unlock alarm mutex");
+			}
+			continue;
+		}
+
+		if (sscanf(line, "reschedule %lu %d", &id, &seconds) == 2) {
+			status = pthread_mutex_lock(&alarm_mutex);
+			if (status != 0) {
+				err_abort(status, "Lock alarm mutex");
+			}
+			if (reschedule_alarm(id, seconds) != 0) {
+				fprintf(stderr, "No pending alarm %lu\n", id);
+			}
+			status = pthread_mutex_unlock(&alarm_mutex);
+			if (status != 0) {
+				err_abort(status, "Unlock alarm mutex");
+			}
+			continue;
+		}
+
 		alarm = malloc(sizeof(alarm_t));
 		if (alarm == NULL) {
 			errno_abort("Allocate alarm_t");
@@ -105,35 +391,9 @@ int main()
 				err_abort(status, "Lock alarm mutex");
 			}
 
-			alarm->time = time(NULL) + alarm->seconds;
-
-			// traversal single alarm list which is sorted by expiration time
-			// last point to head or previous alarm's link member
-			// next point to alarm structure to check
-			alarm_t **last = &alarm_list;
-			alarm_t *next = alarm_list;
-			while (next != NULL) {
-				if (next->time > alarm->time) {
-					alarm->link = next;
-					*last = alarm;
-					break;
-				}
-				last = &next->link;
-				next = next->link;
-			}
+			insert_alarm(alarm);
+			printf("Alarm %lu\n", alarm->id);
 
-			// if list is empty or insert at end of list
-			if (next == NULL) {
-				*last = alarm;
-				alarm->link = NULL;
-			}
-#ifdef DEBUG
-			printf("[list:\n");
-			for (next = alarm_list; next != NULL; next = next->link) {
-				printf("%ld(%ld)\"%s\"\n", alarm->time, alarm->time - time(NULL), alarm->message);
-			}
-			printf("]\n");
-#endif
 			status = pthread_mutex_unlock(&alarm_mutex);
 			if (status != 0) {
 				err_abort(status, "Unlock alarm mutex");
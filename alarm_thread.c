@@ -1,5 +1,6 @@
 #include <pthread.h>
 #include "errors.h"
+#include "pool.h"
 
 typedef struct alarm_tag {
 	int seconds;
@@ -7,6 +8,8 @@ typedef struct alarm_tag {
 	char message[64 + 1];
 } alarm_t;
 
+// alarms are allocated by main thread and freed by each alarm thread
+pool_t alarm_pool;
 
 void *alarm_thread(void *arg)
 {
@@ -19,7 +22,8 @@ void *alarm_thread(void *arg)
 	}
 	sleep(alarm->seconds);
 	printf("(%d)->%s\n", alarm->seconds, alarm->message);
-	free(alarm);
+	// a cache for one object would cost more than the object
+	pool_free_remote(&alarm_pool, alarm);
 	return NULL;
 }
 
@@ -29,9 +33,15 @@ int main()
 	pthread_t pthread;
 	char line[128];
 
+	status = pool_init(&alarm_pool, "alarm_t", sizeof(alarm_t));
+	if (status != 0) {
+		err_abort(status, "Init alarm pool");
+	}
+
 	while (1) {
 		printf("Alarm>\n");
 		if (fgets(line, sizeof(line), stdin) == NULL) {
+			pool_stats(&alarm_pool);
 			exit(0);
 		}
 
@@ -39,14 +49,14 @@ int main()
 			continue;
 		}
 		
-		alarm_t *alarmptr = (alarm_t *)malloc(sizeof(alarm_t));
+		alarm_t *alarmptr = (alarm_t *)pool_alloc(&alarm_pool);
 		if (alarmptr == NULL) {
 			errno_abort("Allocation alarm");
 		}
 
 		if (sscanf(line, "%d %64[^\n]", &alarmptr->seconds, alarmptr->message) < 2) {
 			fprintf(stderr, "Bad command\n");
-			free(alarmptr);
+			pool_free(&alarm_pool, alarmptr);
 		} else {
 			status = pthread_create(&pthread, NULL, alarm_thread, alarmptr);
 			if (status != 0) {
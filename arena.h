@@ -0,0 +1,91 @@
+#ifndef __arena_h
+#define __arena_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "errors.h"
+
+/*
+ * Bump allocator for small objects one thread allocates and any thread
+ * frees, like the names found by a directory walk.
+ *
+ * An arena hands out memory from its current chunk of ARENA_CHUNK bytes
+ * by moving an offset, with no header per object. A chunk counts its
+ * live objects, plus one for the arena while it is the current chunk,
+ * and the thread dropping the count to 0 frees it, so memory goes back
+ * to malloc a chunk at a time once everything allocated from it is
+ * freed. Chunks are aligned to their size, so an object finds its chunk
+ * by masking its address.
+ */
+#define	ARENA_CHUNK	(64 * 1024)
+
+typedef struct arena_chunk_tag {
+	long				live;		/* objects, plus 1 while current */
+} arena_chunk_t;
+
+typedef struct arena_tag {
+	arena_chunk_t			*chunk;		/* current chunk, or NULL */
+	size_t				used;		/* bytes of chunk handed out */
+	long				chunks;		/* chunks allocated */
+} arena_t;
+
+static inline void arena_init(arena_t *arena)
+{
+	arena->chunk = NULL;
+	arena->used = ARENA_CHUNK;
+	arena->chunks = 0;
+}
+
+/* drop a reference to chunk, free it with the last */
+static inline void arena_chunk_put(arena_chunk_t *chunk)
+{
+	if (__atomic_sub_fetch(&chunk->live, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(chunk);
+	}
+}
+
+/* return NULL when out of memory or size doesn't fit a chunk, like malloc */
+static inline void *arena_alloc(arena_t *arena, size_t size)
+{
+	void *object;
+
+	// keep objects aligned for pointers
+	size = (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+	if (size > ARENA_CHUNK - sizeof(arena_chunk_t)) {
+		return NULL;
+	}
+	if (arena->used + size > ARENA_CHUNK) {
+		if (arena->chunk != NULL) {
+			arena_chunk_put(arena->chunk);
+		}
+		if (posix_memalign((void **)&arena->chunk, ARENA_CHUNK, ARENA_CHUNK) != 0) {
+			arena->chunk = NULL;
+			arena->used = ARENA_CHUNK;
+			return NULL;
+		}
+		arena->chunk->live = 1;
+		arena->used = sizeof(arena_chunk_t);
+		++arena->chunks;
+	}
+	object = (char *)arena->chunk + arena->used;
+	arena->used += size;
+	__atomic_add_fetch(&arena->chunk->live, 1, __ATOMIC_RELAXED);
+	return object;
+}
+
+/* free an object of any arena, from any thread */
+static inline void arena_free(void *object)
+{
+	arena_chunk_put((arena_chunk_t *)((uintptr_t)object & ~(uintptr_t)(ARENA_CHUNK - 1)));
+}
+
+/* let the current chunk go once its objects are freed, objects stay valid */
+static inline void arena_destroy(arena_t *arena)
+{
+	if (arena->chunk != NULL) {
+		arena_chunk_put(arena->chunk);
+	}
+	arena_init(arena);
+}
+
+#endif
@@ -1,423 +1,2469 @@
+// sched_setaffinity, CPU_SET and d_type
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include "errors.h"
+#include "pool.h"
+#include "arena.h"
+#include "search.h"
+#include "aho.h"
 
-#define	CREW_SIZE	4
+// largest crew of the benchmark
+#define	CREW_SIZE	64
+#define	CACHE_LINE	64
+// teams of a crew, work goes to a team by the type of its file
+#define	TEAM_DIR	0		/* I/O bound, lstat and read directories */
+#define	TEAM_FILE	1		/* CPU bound, search regular files */
+// initial slots of a worker's deque, it grows by doubling
+#define	DEQUE_SIZE	256
+// rounds over all other workers trying to steal before parking
+#define	STEAL_ROUNDS	4
+// bytes of a file read and searched at a time
+#define	SCAN_BLOCK	(256 * 1024)
+// room in front of a block for the end of the previous one, the search string must fit
+#define	SCAN_KEEP	(SCAN_BLOCK / 2)
+// how files are read, IO_AUTO picks by file size
+#define	IO_AUTO		0
+#define	IO_STDIO	1		/* fread through an unbuffered stream */
+#define	IO_PREAD	2		/* pread of aligned blocks, with readahead hints */
+#define	IO_MMAP		3		/* map the whole file, MADV_SEQUENTIAL */
+// smallest file IO_AUTO maps, mapping costs more than a few reads below it
+#define	IO_MMAP_MIN	(4 * 1024 * 1024)
+// bytes of directory entries read by one getdents64
+#define	DIRENT_BATCH	(64 * 1024)
+// work items a directory worker collects for a team before queueing them at once
+#define	PUSH_BATCH	64
+// what a job prints for what it finds
+#define	FORMAT_TEXT	0		/* OUTPUT: lines, with the worker, and links not followed */
+#define	FORMAT_NUL	1		/* path and a NUL for each file found, like grep -lZ */
+#define	FORMAT_JSON	2		/* a JSON object per line for each pattern found in a file */
+// default bytes of a worker's output buffer, written to the job's stream in one go
+#define	OUTPUT_SIZE	(64 * 1024)
+// bytes of a large file a chunk item searches, and the smallest file split into chunks
+#define	CHUNK_SIZE	(32 * 1024 * 1024)
+#define	SPLIT_MIN	(2 * CHUNK_SIZE)
+// type of the chunk items of a split file, past the DT_ values of directory entries
+#define	DT_CHUNK	0x100
 
+/*
+ * A search started by crew_start, the handle crew_wait waits on. A crew
+ * works on any number of jobs at once, their items mixed in the same
+ * deques, each job counting its own.
+ */
+typedef struct job_tag {
+	// in crew's queue of jobs to start
+	struct job_tag			*next;
+	// work item of the start path
+	struct work_tag			*root;
+	// search string, "" with patterns
+	const char			*search;
+	// compiled patterns searched instead of the search string, or NULL
+	const ac_t			*patterns;
+	// where matches and links not followed go, in FORMAT_TEXT, FORMAT_NUL or FORMAT_JSON
+	FILE				*output;
+	int				format;
+	// bytes a chunk searches before its range, so matches across chunks are found, longest pattern - 1
+	size_t				overlap;
+	// items queued or being worked on, the job is done when it drops to 0
+	long				work_count;
+	// results printed, a file counts once in FORMAT_NUL
+	long				matches;
+	// predicate finished, crew mutex protects it
+	int				finished;
+	pthread_cond_t			done;
+}job_t, *job_p;
+
+/*
+ * A regular file of SPLIT_MIN bytes or more, split into CHUNK_SIZE byte
+ * ranges, each searched from overlap bytes before it. Its chunk items
+ * are all alike, each takes the next chunk no item took, so any worker
+ * may take or steal any of them. What one chunk finds is printed once
+ * for the file, and the rest skip their chunks, or stop between blocks,
+ * once the file has nothing more to be found.
+ */
+typedef struct split_tag {
+	off_t				size;
+	// next chunk to take, and chunks in all
+	long				next;
+	long				chunks;
+	// chunk items not done, the last frees the split
+	long				pending;
+	// search string or patterns found in any chunk, and which patterns
+	long				found;
+	char				seen[];
+}split_t;
+
+/*
+ * Work items come from crew's work_pool, and hold no path, only their
+ * name, in the arena of the worker that read their directory, and their
+ * directory's work item. A directory's item lives on while items in it
+ * do, and keeps the directory open for them to be opened with openat, so
+ * the path is only put together to print it, or when the directory had
+ * to be closed. A chunk item of a split file has the file's item for its
+ * parent, and the split for name.
+ */
 typedef struct work_tag {
-	struct work_tag			*next;
-	char				*path;
-	char				*search;
+	// NULL for the start path
+	struct work_tag			*parent;
+	union {
+		// the start path for the start path
+		const char		*name;
+		// DT_CHUNK
+		split_t			*split;
+	};
+	job_t				*job;
+	// its own, and one for each item in it
+	int				refs;
+	// DT_DIR or DT_REG as the directory entry told, DT_UNKNOWN until lstat, or DT_CHUNK
+	int				type;
+	// a directory read and kept open for the items in it, or -1
+	int				fd;
+	// of its path, which crew_start and crew_walk keep within path_max
+	int				length;
 }work_t, *work_p;
 
+// slots of a deque, replaced by one twice the size when full
+typedef struct deque_array_tag {
+	long				size;
+	// smaller arrays replaced by this one, thieves may still read them
+	struct deque_array_tag		*prev;
+	work_p				item[];
+}deque_array_t;
+
+/*
+ * Chase-Lev work-stealing deque. The owner pushes and pops at bottom,
+ * so it works depth first on what it found last, thieves take the oldest
+ * item at top, which for a directory walk is near the root and likely to
+ * bring a whole subtree with it. Only taking the last item races, and
+ * a CAS on top settles it.
+ */
+typedef struct deque_tag {
+	long				top __attribute__((aligned(CACHE_LINE)));
+	long				bottom __attribute__((aligned(CACHE_LINE)));
+	deque_array_t			*array;
+}deque_t;
+
 typedef struct worker_tag {
+	// own deques, one for the work of each team, first for their alignment
+	deque_t				deque[2];
 	pthread_t			thread;
 	// index in crew
 	int				index;
+	// TEAM_DIR or TEAM_FILE
+	int				team;
+	// CPU the worker is pinned to, or -1
+	int				cpu;
 	// point back to crew
 	struct crew_tag			*crew;
+	// names of the entries of directories the worker read
+	arena_t				arena;
+	// path of the work item at hand, of path_max bytes, built only when needed
+	char				*path;
+	// for picking victims
+	unsigned int			seed;
+	// job of the items done since the last crew_flush, what they printed,
+	// how many they were and what they found, the job's counts lag until then
+	struct job_tag			*job;
+	char				*output;
+	size_t				output_length;
+	long				done;
+	long				matches;
+	// counters for the benchmark, written by the worker only
+	long				items;
+	long				steals;
+	long				parks;
+	long				writes;
 }worker_t, *worker_p;
 
+/*
+ * Workers of a team only take work of their team, they pop it from
+ * their own deque for the team and steal it from the others' deques for
+ * the team. Directory workers queue regular files for the file team.
+ */
+typedef struct team_tag {
+	int				size;
+	// counters of the team's workers, summed by crew_destroy
+	long				items;
+	long				steals;
+	long				parks;
+	long				writes;
+	// workers parked on go
+	int				idle;
+	// predicate there is work for the team to take or steal, or shutdown
+	pthread_cond_t			go;
+}team_t;
+
 typedef struct crew_tag {
+	// directory workers first, then file workers
 	int				crew_size;
-	worker_t			worker[CREW_SIZE];
-	int				work_count;
-	work_p				first;
-	work_p				last;
+	worker_t			*worker;
+	team_t				team[2];
+	// jobs started and not finished
+	int				jobs;
+	// jobs from crew_start, their start paths taken by the directory team before stealing
+	job_p				first;
+	job_p				last;
+	// crew_destroy tells idle workers to exit
+	int				shutdown;
+	// IO_AUTO, IO_STDIO, IO_PREAD or IO_MMAP, set before crew_start
+	int				io_mode;
+	// bytes of each worker's output buffer, 0 writes each line to the stream at once, set before crew_start
+	size_t				output_size;
 	// protect access to crew
 	pthread_mutex_t			mutex;
-	// predicate work_count == 0, there is no more work in crew
+	// predicate jobs == 0, there is no more work in crew
 	pthread_cond_t			done;
-	// predicate work_count > 0, there is more work in crew
-	pthread_cond_t			go;
+	// work items of all jobs
+	pool_t				work_pool;
+	// directories kept open for the items in them, up to half the open file limit
+	long				dir_fds;
+	long				dir_fd_max;
 }crew_t, *crew_p;
 
 size_t path_max;
-size_t name_max;
 
-void *worker_routine(void *arg)
+deque_array_t *deque_array(long size)
 {
-	worker_p mine = (worker_p)arg;
-	work_p work, new_work;
-	crew_p crew = mine->crew;
-	struct stat filestat;
-
-	int status;
+	deque_array_t *array;
 
-	// allocate enough memory for struct dirent
-	// POSIX does not specify the size of d_name field, but requires d_name is the LAST field in struct dirent
-	size_t len = offsetof(struct dirent, d_name) + name_max;
-	struct dirent *entry = malloc(len);
-	if (entry == NULL) {
-		errno_abort("Allocate memory for struct dirent");
+	array = malloc(sizeof(deque_array_t) + size * sizeof(work_p));
+	if (array == NULL) {
+		errno_abort("Allocate memory for deque");
 	}
+	array->size = size;
+	array->prev = NULL;
+	return array;
+}
 
-	// when thread start, the work_count == 0, so wait until there is works to do
-	status = pthread_mutex_lock(&crew->mutex);
-	if (status != 0) {
-		err_abort(status, "Lock crew mutex");
-	}
+void deque_init(deque_t *deque)
+{
+	deque->top = deque->bottom = 0;
+	deque->array = deque_array(DEQUE_SIZE);
+}
 
-	DPRINTF(("worker %d: wait work on (crew->work_count == 0), crew->work_count %d\n", mine->index, crew->work_count));
-	while (crew->work_count == 0) {
-		status = pthread_cond_wait(&crew->go, &crew->mutex);
-		if (status != 0) {
-			err_abort(status, "Wait on go cond for more work");
-		}
-	}
+void deque_destroy(deque_t *deque)
+{
+	deque_array_t *array, *prev;
 
-	status = pthread_mutex_unlock(&crew->mutex);
-	if (status != 0) {
-		err_abort(status, "Unlock crew mutex");
+	for (array = deque->array; array != NULL; array = prev) {
+		prev = array->prev;
+		free(array);
 	}
+}
 
-	DPRINTF(("worker %d: start to work\n", mine->index));
-
-
-	// get work item from crew, decrement the work_count AFTER deal with it,
-	// if crew->first == NULL, then there is no work temporary
-	// if crew->work_count <= 0, then the work of crew is done
-	while (1) {
-		// get work item from crew
-		status = pthread_mutex_lock(&crew->mutex);
-		if (status != 0) {
-			err_abort(status, "Lock crew mutex");
-		}
-
-		DPRINTF(("worker %d: wait work on (crew->first == NULL) work count %d\n", mine->index, crew->work_count));
-		while (crew->first == NULL) {
-			status = pthread_cond_wait(&crew->go, &crew->mutex);
-			if (status != 0) {
-				err_abort(status, "Wait on go cond for more work");
-			}
-		}
-
-		// get work item from crew
-		work = crew->first;
-		DPRINTF(("worker %d: get work %p, work count %d, work path %s\n", mine->index, work, crew->work_count, work->path));
-		crew->first = work->next;
-		if (crew->first == NULL) {
-			crew->last = NULL;
-		}
+// number of items, may be stale by the time caller looks at it
+long deque_size(deque_t *deque)
+{
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+	long top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
 
-		status = pthread_mutex_unlock(&crew->mutex);
-		if (status != 0) {
-			err_abort(status, "Unlock crew mutex");
-		}
+	return bottom - top;
+}
 
-		// precess work item
-		status = lstat(work->path, &filestat);
-		if (status != 0) {
-			errno_abort("lstat error");
-		}
+// caller MUST be the owner
+void deque_push(deque_t *deque, work_p work)
+{
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	deque_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED), *bigger;
+	long i;
 
-		// link file
-		if (S_ISLNK(filestat.st_mode)) {
-			printf("OUTPUT: worker %d: don't follow link %s\n", mine->index, work->path);
+	if (bottom - top > array->size - 1) {
+		bigger = deque_array(array->size * 2);
+		for (i = top; i < bottom; ++i) {
+			bigger->item[i & (bigger->size - 1)] = array->item[i & (array->size - 1)];
 		}
-		// directory file
-		else if (S_ISDIR(filestat.st_mode)) {
-			DIR *dir;
-			struct dirent *result;
-			dir = opendir(work->path);
-			if (dir == NULL) {
-				fprintf(stderr, "OUTPUT: worker %d: Can't open directory %s, %d(%s)\n", mine->index, work->path, errno, strerror(errno));
-				continue;
-			}
-
-			while (1) {
-				status = readdir_r(dir, entry, &result);
-				if (status != 0) {
-					fprintf(stderr, "OUTPUT: worker %d: Can't read directory %s, %d(%s)\n", mine->index, work->path, errno, strerror(errno));
-					break;
-				}
-				// end of directory stream
-				if (result == NULL) {
-					break;
-				}
-
-				if (strcmp(entry->d_name, ".") == 0
-						|| strcmp(entry->d_name, "..") == 0) {
-					continue;
-				}
-
-				new_work = malloc(sizeof(work_t));
-				if (new_work == NULL) {
-					errno_abort("Allocate memory for new work");
-				}
-				new_work->path = malloc(path_max);
-				if (new_work->path == NULL) {
-					errno_abort("Allocate memory for new work's path");
-				}
-				strcpy(new_work->path, work->path);
-				strcat(new_work->path, "/");
-				strcat(new_work->path, entry->d_name);
-
-				new_work->search = work->search;
-				new_work->next = NULL;
-
-				status = pthread_mutex_lock(&crew->mutex);
-				if (status != 0) {
-					err_abort(status, "Lock crew mutex");
-				}
-
-				if (crew->first == NULL) {
-					crew->first = crew->last = new_work;
-				} else {
-					crew->last->next = new_work;
-					crew->last = new_work;
-				}
-				crew->work_count++;
-				DPRINTF(("worker %d: add work, work %p work count %d, work path %s\n", mine->index, new_work, crew->work_count, new_work->path));
-				status = pthread_cond_signal(&crew->go);
-				if (status != 0) {
-					err_abort(status, "Signal go cond after insert new work item");
-				}
+		// thieves holding the old array can still read it, free it with the deque
+		bigger->prev = array;
+		__atomic_store_n(&deque->array, bigger, __ATOMIC_RELEASE);
+		array = bigger;
+	}
+	__atomic_store_n(&array->item[bottom & (array->size - 1)], work, __ATOMIC_RELAXED);
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
 
-				status = pthread_mutex_unlock(&crew->mutex);
-				if (status != 0) {
-					err_abort(status, "Unlock crew mutex");
-				}
+// take the newest item, return NULL when empty, caller MUST be the owner
+work_p deque_pop(deque_t *deque)
+{
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	deque_array_t *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+	long top;
+	work_p work = NULL;
 
-			}
+	// claim the bottom slot before looking at top, thieves check bottom after claiming top
+	__atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
 
-			status = closedir(dir);
-			if (status != 0) {
-				fprintf(stderr, "OUTPUT: worker %d: Can't close directory %s, %d(%s)\n", mine->index, work->path, errno, strerror(errno));
+	if (top <= bottom) {
+		work = __atomic_load_n(&array->item[bottom & (array->size - 1)], __ATOMIC_RELAXED);
+		if (top == bottom) {
+			// last item, race thieves for it
+			if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+						__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				work = NULL;
 			}
+			__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
 		}
-		// regular file
-		else if (S_ISREG(filestat.st_mode)) {
-			FILE *file;
-			char buffer[256];
-			char *bufferptr, *search;
-
-			file = fopen(work->path, "r");
-			if (file == NULL) {
-				fprintf(stderr, "OUTPUT: worker %d: Can't read file %s, %d(%s)\n", mine->index, work->path, errno, strerror(errno));
-				continue;
-			}
-
-			while (1) {
-				bufferptr = fgets(buffer, sizeof(buffer), file);
-				if (bufferptr == NULL) {
-					if (ferror(file)) {
-						fprintf(stderr, "OUTPUT: worker %d: Can't read file %s, %d(%s)\n", mine->index, work->path, errno, strerror(errno));
-						break;
-					}
-
-					if (feof(file)) {
-						break;
-					}
-				}
+	} else {
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+	return work;
+}
 
-				search = strstr(buffer, work->search);
-				if (search != NULL) {
-					printf("OUTPUT: worker %d: find %s from %s\n", mine->index, work->search, work->path);
-					break;
-				}
-			}
+// take the oldest item, return NULL when empty or another thread won it
+work_p deque_steal(deque_t *deque)
+{
+	long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	long bottom;
+	deque_array_t *array;
+	work_p work;
 
-			status = fclose(file);
-			if (status != 0) {
-				fprintf(stderr, "OUTPUT: worker %d: Can't close file %s, %d(%s)\n", mine->index, work->path, errno, strerror(errno));
-			}
-		}
-		else {
-			fprintf(stderr, "OUTPUT: worker %d: %s file type is %d(%s)\n", mine->index, work->path, filestat.st_mode & S_IFMT,
-					S_ISFIFO(filestat.st_mode) ? "FIFO"
-					: S_ISCHR(filestat.st_mode) ? "CHR"
-					: S_ISBLK(filestat.st_mode) ? "BLK"
-					: S_ISSOCK(filestat.st_mode) ? "SOCK"
-					: "UNKNOWN");
-		}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if (top >= bottom) {
+		return NULL;
+	}
 
-		DPRINTF(("worker %d: finish work %p, work count %d, work path %s\n", mine->index, work, crew->work_count, work->path));
-		free(work->path);
-		free(work);
+	array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+	work = __atomic_load_n(&array->item[top & (array->size - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	return work;
+}
 
-		// decrement work count
-		status = pthread_mutex_lock(&crew->mutex);
-		if (status != 0) {
-			err_abort(status, "Lock crew mutex");
-		}
+// work for team is visible to a worker looking for it, caller MUST have crew mutex locked
+int crew_has_work(crew_p crew, int team)
+{
+	int i;
 
-		--crew->work_count;
-		DPRINTF(("worker %d: decrement work count %d\n", mine->index, crew->work_count));
-		if (crew->work_count == 0) {
-			status = pthread_cond_signal(&crew->done);
-			if (status != 0) {
-				err_abort(status, "Signal done cond");
-			}
-			status = pthread_mutex_unlock(&crew->mutex);
-			if (status != 0) {
-				err_abort(status, "Unlock crew mutex");
-			}
-			break;
-		}
-		status = pthread_mutex_unlock(&crew->mutex);
-		if (status != 0) {
-			err_abort(status, "Unlock crew mutex");
+	if (team == TEAM_DIR && crew->first != NULL) {
+		return 1;
+	}
+	for (i = 0; i < crew->crew_size; ++i) {
+		if (deque_size(&crew->worker[i].deque[team]) > 0) {
+			return 1;
 		}
-		sched_yield();
 	}
-
-	free(entry);
-	return NULL;
+	return 0;
 }
 
-int create_crew(crew_p crew, int crew_size)
+/*
+ * queue count items of work for team, found by worker mine, and wake
+ * parked workers of team to steal them, counted is set when passing on
+ * work already counted
+ */
+void crew_push(worker_p mine, work_p *work, int count, int team, int counted)
 {
 	int status, i;
+	crew_p crew = mine->crew;
 
-	if (crew_size > CREW_SIZE) {
-		return EINVAL;
+	// items of a batch are of one job
+	if (!counted) {
+		__atomic_add_fetch(&work[0]->job->work_count, count, __ATOMIC_SEQ_CST);
+	}
+	for (i = 0; i < count; ++i) {
+		deque_push(&mine->deque[team], work[i]);
 	}
 
-	crew->crew_size = crew_size;
-	crew->work_count = 0;
-	crew->first = crew->last = NULL;
-
-	status = pthread_mutex_init(&crew->mutex, NULL);
+	// pairs with the idle increment in crew_park, either it sees the push or we see it idle
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&crew->team[team].idle, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+	status = pthread_mutex_lock(&crew->mutex);
 	if (status != 0) {
-		return status;
+		err_abort(status, "Lock crew mutex");
+	}
+	if (count > 1) {
+		status = pthread_cond_broadcast(&crew->team[team].go);
+	} else {
+		status = pthread_cond_signal(&crew->team[team].go);
 	}
-	status = pthread_cond_init(&crew->go, NULL);
 	if (status != 0) {
-		return status;
+		err_abort(status, "Signal go cond after insert new work item");
 	}
-	status = pthread_cond_init(&crew->done, NULL);
+	status = pthread_mutex_unlock(&crew->mutex);
 	if (status != 0) {
-		return status;
+		err_abort(status, "Unlock crew mutex");
 	}
+}
 
-	for (i = 0; i < CREW_SIZE; ++i) {
-		crew->worker[i].index = i;
-		crew->worker[i].crew = crew;
-		status = pthread_create(&crew->worker[i].thread, NULL, worker_routine, &crew->worker[i]);
-		if (status != 0) {
-			err_abort(status, "Create worker");
+// take the start path of a job from crew_start, return NULL when there is none
+work_p crew_take(crew_p crew)
+{
+	int status;
+	job_p job;
+
+	if (__atomic_load_n(&crew->first, __ATOMIC_RELAXED) == NULL) {
+		return NULL;
+	}
+	status = pthread_mutex_lock(&crew->mutex);
+	if (status != 0) {
+		err_abort(status, "Lock crew mutex");
+	}
+	job = crew->first;
+	if (job != NULL) {
+		__atomic_store_n(&crew->first, job->next, __ATOMIC_RELAXED);
+		if (crew->first == NULL) {
+			crew->last = NULL;
 		}
 	}
+	status = pthread_mutex_unlock(&crew->mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock crew mutex");
+	}
+	return job != NULL ? job->root : NULL;
+}
 
-	return 0;
+// steal work of mine's team from other workers picked at random, return NULL when all looked empty
+work_p crew_steal(worker_p mine)
+{
+	crew_p crew = mine->crew;
+	int round, i, victim;
+	work_p work;
+
+	for (round = 0; round < STEAL_ROUNDS; ++round) {
+		victim = rand_r(&mine->seed) % crew->crew_size;
+		for (i = 0; i < crew->crew_size; ++i, victim = (victim + 1) % crew->crew_size) {
+			if (victim == mine->index) {
+				continue;
+			}
+			work = deque_steal(&crew->worker[victim].deque[mine->team]);
+			if (work != NULL) {
+				++mine->steals;
+				return work;
+			}
+		}
+		sched_yield();
+	}
+	return NULL;
 }
 
-int crew_start(crew_p crew, const char *path, char *search)
+// wait on team's go until there may be work for the team or crew_destroy tells workers to exit
+void crew_park(worker_p mine)
 {
 	int status;
-	work_p work;
+	crew_p crew = mine->crew;
+	team_t *team = &crew->team[mine->team];
 
 	status = pthread_mutex_lock(&crew->mutex);
 	if (status != 0) {
-		return status;
+		err_abort(status, "Lock crew mutex");
 	}
-
-	// if crew is busy, then wait
-	while (crew->work_count > 0) {
-		status = pthread_cond_wait(&crew->done, &crew->mutex);
+	__atomic_add_fetch(&team->idle, 1, __ATOMIC_SEQ_CST);
+	while (!crew_has_work(crew, mine->team) && !crew->shutdown) {
+		++mine->parks;
+		status = pthread_cond_wait(&team->go, &crew->mutex);
 		if (status != 0) {
-			pthread_mutex_unlock(&crew->mutex);
-			return status;
+			err_abort(status, "Wait on go cond for more work");
 		}
 	}
+	__atomic_sub_fetch(&team->idle, 1, __ATOMIC_SEQ_CST);
+	status = pthread_mutex_unlock(&crew->mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock crew mutex");
+	}
+}
 
-	errno = 0;
-	path_max = pathconf(path, _PC_PATH_MAX);
-	if (path_max == -1) {
-		if (errno == 0) {
-			path_max = 1024;
+/* drop a reference to work, free it and its name with the last, and drop its reference to its parent then */
+void work_release(crew_p crew, work_p work)
+{
+	work_p parent;
+
+	while (work != NULL && __atomic_sub_fetch(&work->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		parent = work->parent;
+		// the start path belongs to crew_start's caller, and a split to its chunks
+		if (parent != NULL && work->type != DT_CHUNK) {
+			arena_free((void *)work->name);
 		}
-		else {
-			errno_abort("Unable to get _PC_PATH_MAX");
+		if (work->fd >= 0) {
+			close(work->fd);
+			__atomic_sub_fetch(&crew->dir_fds, 1, __ATOMIC_RELAXED);
 		}
+		pool_free(&crew->work_pool, work);
+		work = parent;
 	}
+}
 
-	errno = 0;
-	name_max = pathconf(path, _PC_NAME_MAX);
-	if (name_max == -1) {
-		if (errno == 0) {
-			name_max = 256;
-		}
-		else {
-			errno_abort("Unable to get _PC_NAME_MAX");
+/* put the path of work in mine's path, from its name back up to the start path, and return it */
+const char *work_path(worker_p mine, work_p work)
+{
+	char *end = mine->path + work->length;
+	size_t name_length;
+
+	*end = '\0';
+	for (; work != NULL; work = work->parent) {
+		name_length = work->parent != NULL ? work->length - work->parent->length - 1 : work->length;
+		end -= name_length;
+		memcpy(end, work->name, name_length);
+		if (work->parent != NULL) {
+			*--end = '/';
 		}
 	}
+	return mine->path;
+}
 
-	// plus 1 for terminal '\0'
-	++path_max;
-	++name_max;
-
-	work = malloc(sizeof(work_t));
-	if (work == NULL) {
-		errno_abort("Allocate memory for new work");
+/* open work relative to its directory, or by its path when the directory wasn't kept open */
+int work_open(worker_p mine, work_p work, int flags)
+{
+	if (work->parent != NULL && work->parent->fd >= 0) {
+		return openat(work->parent->fd, work->name, flags);
 	}
-	work->path = malloc(path_max);
-	if (work->path == NULL) {
-		errno_abort("Allocate memory for new work's path");
+	return open(work_path(mine, work), flags);
+}
+
+// release a finished work item, its job counts it at mine's next crew_flush
+void crew_finish(worker_p mine, work_p work)
+{
+	work_release(mine->crew, work);
+	++mine->done;
+}
+
+// write what mine buffered to the stream of its job in one fwrite
+void output_drain(worker_p mine)
+{
+	if (mine->output_length == 0) {
+		return;
 	}
+	fwrite(mine->output, 1, mine->output_length, mine->job->output);
+	mine->output_length = 0;
+	++mine->writes;
+}
 
-	strcpy(work->path, path);
-	work->search = search;
-	work->next = NULL;
+/*
+ * Write what mine buffered for its job, then count the items it did
+ * since the last flush as done, and finish the job when they were its
+ * last, so crew_wait returns only once all of the job's output is
+ * written. Workers flush before they park and when they go on to an item
+ * of another job, so a job is never left waiting on a worker that has
+ * nothing to do. Return 1 when it finished the job.
+ */
+int crew_flush(worker_p mine)
+{
+	int status;
+	crew_p crew = mine->crew;
+	job_p job = mine->job;
+	long done = mine->done;
 
-	if (crew->first == NULL) {
-		crew->first = crew->last = work;
+	if (job == NULL) {
+		return 0;
 	}
-	else {
-		crew->last->next = work;
-		crew->last = work;
+	output_drain(mine);
+	if (mine->matches > 0) {
+		__atomic_add_fetch(&job->matches, mine->matches, __ATOMIC_RELAXED);
+	}
+	mine->job = NULL;
+	mine->done = mine->matches = 0;
+	if (done == 0 || __atomic_sub_fetch(&job->work_count, done, __ATOMIC_SEQ_CST) > 0) {
+		return 0;
 	}
-	++crew->work_count;
 
-	status = pthread_cond_signal(&crew->go);
+	// crew_wait returns, and may free job once the mutex is unlocked
+	status = pthread_mutex_lock(&crew->mutex);
 	if (status != 0) {
-		free(work->path);
-		free(work);
-		crew->first = crew->last = NULL;
-		crew->work_count = 0;
-		pthread_mutex_unlock(&crew->mutex);
-		return status;
+		err_abort(status, "Lock crew mutex");
 	}
-
-	while (crew->work_count > 0) {
-		status = pthread_cond_wait(&crew->done, &crew->mutex);
+	job->finished = 1;
+	status = pthread_cond_broadcast(&job->done);
+	if (status != 0) {
+		err_abort(status, "Broadcast job done cond");
+	}
+	if (--crew->jobs == 0) {
+		status = pthread_cond_broadcast(&crew->done);
 		if (status != 0) {
-			err_abort(status, "Wait on cond crew done");
+			err_abort(status, "Broadcast done cond");
 		}
 	}
-
 	status = pthread_mutex_unlock(&crew->mutex);
 	if (status != 0) {
 		err_abort(status, "Unlock crew mutex");
 	}
+	return 1;
+}
+
+/*
+ * what a worker looks for in a file, the search string of the job, or
+ * the job's patterns, and how far it got
+ */
+typedef struct scan_tag {
+	const char			*search;
+	size_t				length;
+	// bytes in front of a block from the previous one, for search
+	size_t				keep;
+	// NULL for search
+	const ac_t			*patterns;
+	// automaton state, and patterns found
+	int				state;
+	ac_match_t			*match;
+	// the split file of a chunk, or NULL
+	split_t				*split;
+}scan_t;
+
+/* the split of a chunk scanned has nothing more to be found */
+int scan_cancelled(scan_t *scan)
+{
+	if (scan->split == NULL) {
+		return 0;
+	}
+	return __atomic_load_n(&scan->split->found, __ATOMIC_RELAXED)
+		>= (scan->patterns != NULL ? scan->patterns->patterns : 1);
+}
+
+/* search size bytes of data, that follow what scan has seen of the file */
+int scan_region(scan_t *scan, const char *data, size_t size)
+{
+	if (scan->patterns != NULL) {
+		return ac_scan(scan->patterns, &scan->state, data, size, scan->match);
+	}
+	return search_block(data, size, scan->search, scan->length) != NULL;
+}
+
+/*
+ * search data read into block + SCAN_KEEP, after the last keep bytes of
+ * the previous read in front of it, and keep what may start a match,
+ * patterns need no keep as the automaton state carries over
+ */
+int scan_data(scan_t *scan, char *block, size_t count)
+{
+	char *data = block + SCAN_KEEP;
 
+	if (scan->patterns != NULL) {
+		return scan_region(scan, data, count);
+	}
+	if (scan_region(scan, data - scan->keep, scan->keep + count)) {
+		return 1;
+	}
+	// a match may start in the last length - 1 bytes and end in the next block
+	scan->keep = scan->length - 1 < scan->keep + count ? scan->length - 1 : scan->keep + count;
+	memmove(data - scan->keep, data + count - scan->keep, scan->keep);
 	return 0;
 }
 
+// all scan_ functions return 1 when no more is to be found, 0 when the whole file is searched,
+// -1 with errno on error
 
-int main(int argc, char **argv)
+// the stream takes over fd, and closes it
+int scan_stdio(int fd, scan_t *scan, char *block)
 {
-	int status;
-	crew_t crew;
+	FILE *file;
+	size_t count;
+	int found = 0, error = 0;
 
-	if (argc < 3) {
-		fprintf(stderr, "%s path string\n", argv[0]);
+	file = fdopen(fd, "r");
+	if (file == NULL) {
+		close(fd);
 		return -1;
 	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	// reads are as large as the stdio buffer would be, so skip copying through it
+	setvbuf(file, NULL, _IONBF, 0);
 
-	status = create_crew(&crew, CREW_SIZE);
-	if (status != 0) {
-		err_abort(status, "Create crew");
+	while (!found) {
+		count = fread(block + SCAN_KEEP, 1, SCAN_BLOCK, file);
+		if (count == 0) {
+			if (ferror(file)) {
+				error = errno;
+			}
+			break;
+		}
+		found = scan_data(scan, block, count);
 	}
 
-	status = crew_start(&crew, argv[1], argv[2]);
-	if (status != 0) {
-		err_abort(status, "Crew start");
+	fclose(file);
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return found;
+}
+
+// read from offset to end, or EOF
+int scan_pread(int fd, off_t offset, off_t end, scan_t *scan, char *block)
+{
+	ssize_t count;
+
+	// double the kernel's readahead window
+	posix_fadvise(fd, offset, end - offset, POSIX_FADV_SEQUENTIAL);
+	while (offset < end) {
+		if (scan_cancelled(scan)) {
+			return 1;
+		}
+		count = pread(fd, block + SCAN_KEEP, end - offset < SCAN_BLOCK ? end - offset : SCAN_BLOCK, offset);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			return count;
+		}
+		offset += count;
+		// start reading the next block in while searching this one
+		posix_fadvise(fd, offset, SCAN_BLOCK, POSIX_FADV_WILLNEED);
+		if (scan_data(scan, block, count)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// map size bytes from offset, and search them SCAN_BLOCK at a time, a search string overlapping the next
+int scan_mmap(int fd, off_t offset, off_t size, scan_t *scan)
+{
+	char *map, *data;
+	off_t start, i, count;
+	size_t extra = scan->patterns != NULL || scan->length == 0 ? 0 : scan->length - 1;
+	int found = 0;
+
+	if (size == 0) {
+		return 0;
+	}
+	// mappings start on a page
+	start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	map = mmap(NULL, size + offset - start, PROT_READ, MAP_PRIVATE, fd, start);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	// aggressive readahead, and pages behind are dropped first
+	madvise(map, size + offset - start, MADV_SEQUENTIAL);
+	data = map + (offset - start);
+	for (i = 0; i < size && !found; i += SCAN_BLOCK) {
+		if (scan_cancelled(scan)) {
+			found = 1;
+			break;
+		}
+		count = i + SCAN_BLOCK + extra < size ? SCAN_BLOCK + extra : size - i;
+		found = scan_region(scan, data + i, count);
+	}
+	munmap(map, size + offset - start);
+	return found;
+}
+
+/* add size bytes of data to mine's output, what doesn't fit the buffer goes straight to the stream */
+void output_write(worker_p mine, const char *data, size_t size)
+{
+	size_t output_size = mine->crew->output_size;
+
+	if (mine->output_length + size > output_size) {
+		output_drain(mine);
+		if (size > output_size) {
+			fwrite(data, 1, size, mine->job->output);
+			++mine->writes;
+			return;
+		}
+	}
+	memcpy(mine->output + mine->output_length, data, size);
+	mine->output_length += size;
+}
+
+/* add a printf formatted line to mine's output */
+void output_printf(worker_p mine, const char *format, ...)
+{
+	va_list args;
+	size_t room = mine->crew->output_size - mine->output_length;
+	int length;
+
+	va_start(args, format);
+	length = vsnprintf(mine->output + mine->output_length, room, format, args);
+	va_end(args);
+	if ((size_t)length < room) {
+		mine->output_length += length;
+		return;
+	}
+
+	// format again into the drained buffer, or straight to the stream
+	output_drain(mine);
+	va_start(args, format);
+	if ((size_t)length < mine->crew->output_size) {
+		mine->output_length = vsnprintf(mine->output, mine->crew->output_size, format, args);
+	} else {
+		vfprintf(mine->job->output, format, args);
+		++mine->writes;
+	}
+	va_end(args);
+}
+
+/* add string to mine's output as the inside of a JSON string, bytes over 0x7f go as they are */
+void output_json(worker_p mine, const char *string)
+{
+	const char *run;
+	char escape[8];
+
+	for (run = string; *string != '\0'; ++string) {
+		if (*string != '"' && *string != '\\' && (unsigned char)*string >= 0x20) {
+			continue;
+		}
+		output_write(mine, run, string - run);
+		if (*string == '"' || *string == '\\') {
+			escape[0] = '\\';
+			escape[1] = *string;
+			output_write(mine, escape, 2);
+		} else {
+			snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)*string);
+			output_write(mine, escape, 6);
+		}
+		run = string + 1;
+	}
+	output_write(mine, run, string - run);
+}
+
+/* add what job found, match in the file at path, to mine's output in the job's format */
+void output_match(worker_p mine, job_p job, const char *path, const char *match)
+{
+	++mine->matches;
+	if (job->format == FORMAT_NUL) {
+		output_write(mine, path, strlen(path) + 1);
+	} else if (job->format == FORMAT_JSON) {
+		output_write(mine, "{\"path\":\"", 9);
+		output_json(mine, path);
+		output_write(mine, "\",\"match\":\"", 11);
+		output_json(mine, match);
+		output_write(mine, "\"}\n", 3);
+	} else {
+		output_printf(mine, "OUTPUT: worker %d: find %s from %s\n", mine->index, match, path);
+	}
+}
+
+/* report an entry of job of type neither directory nor regular file, name is NULL when path is the entry */
+void report_type(worker_p mine, job_p job, const char *path, const char *name, int type)
+{
+	if (type == DT_LNK) {
+		// not a result, only the text format tells
+		if (job->format == FORMAT_TEXT) {
+			output_printf(mine, "OUTPUT: worker %d: don't follow link %s%s%s\n", mine->index, path,
+					name != NULL ? "/" : "", name != NULL ? name : "");
+		}
+		return;
+	}
+	fprintf(stderr, "OUTPUT: worker %d: %s%s%s file type is %d(%s)\n", mine->index, path,
+			name != NULL ? "/" : "", name != NULL ? name : "", DTTOIF(type),
+			type == DT_FIFO ? "FIFO"
+			: type == DT_CHR ? "CHR"
+			: type == DT_BLK ? "BLK"
+			: type == DT_SOCK ? "SOCK"
+			: "UNKNOWN");
+}
+
+/* set scan up to search for job's patterns if it has them, or for job's search string */
+void scan_init(scan_t *scan, job_p job, ac_match_t *match)
+{
+	scan->search = job->search;
+	scan->length = strlen(job->search);
+	scan->keep = 0;
+	scan->patterns = job->patterns;
+	scan->state = 0;
+	scan->match = match;
+	scan->split = NULL;
+}
+
+/*
+ * split the regular file of work, of size bytes, into chunk items for
+ * the file team, queued on mine's deque for others to steal
+ */
+void split_file(worker_p mine, work_p work, off_t size)
+{
+	job_p job = work->job;
+	work_p batch[PUSH_BATCH];
+	split_t *split;
+	long i, count = 0;
+
+	split = calloc(1, sizeof(split_t) + (job->patterns != NULL ? job->patterns->patterns : 0));
+	if (split == NULL) {
+		errno_abort("Allocate memory for split file");
+	}
+	split->size = size;
+	split->chunks = split->pending = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+	for (i = 0; i < split->chunks; ++i) {
+		batch[count] = pool_alloc(&mine->crew->work_pool);
+		if (batch[count] == NULL) {
+			errno_abort("Allocate memory for new work");
+		}
+		batch[count]->parent = work;
+		batch[count]->split = split;
+		batch[count]->job = job;
+		batch[count]->refs = 1;
+		batch[count]->type = DT_CHUNK;
+		batch[count]->fd = -1;
+		batch[count]->length = work->length;
+		if (++count == PUSH_BATCH || i == split->chunks - 1) {
+			__atomic_add_fetch(&work->refs, count, __ATOMIC_RELAXED);
+			crew_push(mine, batch, count, TEAM_FILE, 0);
+			count = 0;
+		}
+	}
+}
+
+/*
+ * search the regular file of work in the crew's I/O mode, or split it
+ * when it is large and there are other file workers to share it, the
+ * size comes from fstat of the open file, not lstat of its path
+ */
+void scan_file(worker_p mine, work_p work, char *block, ac_match_t *match)
+{
+	int fd, found, i, mode = mine->crew->io_mode;
+	job_p job = work->job;
+	struct stat filestat;
+	const char *path = NULL;
+	scan_t scan;
+
+	scan_init(&scan, job, match);
+
+	fd = work_open(mine, work, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0) {
+		found = -1;
+	} else if (fstat(fd, &filestat) != 0) {
+		found = -1;
+		close(fd);
+	} else if (!S_ISREG(filestat.st_mode)) {
+		// replaced since its directory was read
+		report_type(mine, job, work_path(mine, work), NULL, IFTODT(filestat.st_mode));
+		close(fd);
+		return;
+	} else if (filestat.st_size >= SPLIT_MIN && mine->crew->team[TEAM_FILE].size > 1) {
+		close(fd);
+		split_file(mine, work, filestat.st_size);
+		return;
+	} else {
+		if (mode == IO_AUTO) {
+			mode = filestat.st_size < IO_MMAP_MIN ? IO_PREAD : IO_MMAP;
+		}
+		if (mode == IO_STDIO) {
+			found = scan_stdio(fd, &scan, block);
+		} else {
+			if (mode == IO_MMAP) {
+				found = scan_mmap(fd, 0, filestat.st_size, &scan);
+			} else {
+				found = scan_pread(fd, 0, filestat.st_size, &scan, block);
+			}
+			close(fd);
+		}
+	}
+
+	// the path is only wanted to print it
+	if (found != 0 || (scan.patterns != NULL && match->count > 0)) {
+		path = work_path(mine, work);
+	}
+	// patterns found before an error are reported too
+	// the NUL format lists a file once
+	if (scan.patterns != NULL) {
+		for (i = 0; i < (job->format == FORMAT_NUL && match->count > 0 ? 1 : match->count); ++i) {
+			output_match(mine, job, path, scan.patterns->pattern[match->found[i]]);
+		}
+		ac_match_reset(match);
+	} else if (found > 0) {
+		output_match(mine, job, path, scan.search);
+	}
+	if (found < 0) {
+		fprintf(stderr, "OUTPUT: worker %d: Can't read file %s, %d(%s)\n", mine->index, path, errno, strerror(errno));
+	}
+}
+
+/*
+ * search the next chunk of the split file of work's parent no item took,
+ * from the job's overlap before it, chunks read with pread in IO_STDIO
+ * mode, and print what the file had not found yet
+ */
+void scan_chunk(worker_p mine, work_p work, char *block, ac_match_t *match)
+{
+	int fd, found, i, p, mode = mine->crew->io_mode;
+	job_p job = work->job;
+	split_t *split = work->split;
+	const char *path = NULL;
+	off_t start, end;
+	scan_t scan;
+
+	scan_init(&scan, job, match);
+	scan.split = split;
+
+	start = __atomic_fetch_add(&split->next, 1, __ATOMIC_RELAXED) * (off_t)CHUNK_SIZE;
+	end = start + CHUNK_SIZE < split->size ? start + CHUNK_SIZE : split->size;
+	start = start > (off_t)job->overlap ? start - job->overlap : 0;
+
+	if (!scan_cancelled(&scan)) {
+		fd = work_open(mine, work->parent, O_RDONLY | O_NOFOLLOW);
+		if (fd < 0) {
+			found = -1;
+		} else {
+			if (mode == IO_AUTO || mode == IO_MMAP) {
+				found = scan_mmap(fd, start, end - start, &scan);
+			} else {
+				found = scan_pread(fd, start, end, &scan, block);
+			}
+			close(fd);
+		}
+
+		if (found != 0 || (scan.patterns != NULL && match->count > 0)) {
+			path = work_path(mine, work->parent);
+		}
+		// each found once for the file, by whichever chunk got there first
+		if (scan.patterns != NULL) {
+			for (i = 0; i < match->count; ++i) {
+				p = match->found[i];
+				if (__atomic_exchange_n(&split->seen[p], 1, __ATOMIC_RELAXED) == 0
+						&& (__atomic_add_fetch(&split->found, 1, __ATOMIC_RELAXED) == 1 || job->format != FORMAT_NUL)) {
+					output_match(mine, job, path, scan.patterns->pattern[p]);
+				}
+			}
+			ac_match_reset(match);
+		} else if (found > 0 && __atomic_exchange_n(&split->found, 1, __ATOMIC_RELAXED) == 0) {
+			output_match(mine, job, path, scan.search);
+		}
+		if (found < 0) {
+			fprintf(stderr, "OUTPUT: worker %d: Can't read file %s, %d(%s)\n", mine->index, path, errno, strerror(errno));
+		}
+	}
+
+	if (__atomic_sub_fetch(&split->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(split);
+	}
+}
+
+/*
+ * Read the directory of work in DIRENT_BATCH bytes of entries per
+ * getdents64, instead of an entry per readdir, and queue its directories
+ * and regular files as the entries' d_type tells, PUSH_BATCH at a time
+ * for each team. Only entries the file system gives no d_type get a
+ * fstatat, relative to the open directory rather than a path looked up
+ * from the root again, other types are reported here and never queued.
+ * Names of the items queued go to mine's arena, and the directory stays
+ * open for them while the crew's budget of directory fds allows.
+ */
+void crew_walk(worker_p mine, work_p work, char *buffer)
+{
+	crew_p crew = mine->crew;
+	work_p batch[2][PUSH_BATCH], new_work;
+	int count[2] = {0, 0};
+	struct dirent64 *entry;
+	struct stat filestat;
+	size_t name_length;
+	ssize_t size, offset;
+	int fd, type, team;
+	char *name;
+
+	fd = work_open(mine, work, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0) {
+		fprintf(stderr, "OUTPUT: worker %d: Can't open directory %s, %d(%s)\n", mine->index, work_path(mine, work), errno, strerror(errno));
+		return;
+	}
+	// set before its items are queued, and closed with the last of them
+	if (__atomic_add_fetch(&crew->dir_fds, 1, __ATOMIC_RELAXED) <= crew->dir_fd_max) {
+		work->fd = fd;
+	} else {
+		__atomic_sub_fetch(&crew->dir_fds, 1, __ATOMIC_RELAXED);
+	}
+
+	while ((size = getdents64(fd, buffer, DIRENT_BATCH)) > 0) {
+		for (offset = 0; offset < size; offset += entry->d_reclen) {
+			entry = (struct dirent64 *)(buffer + offset);
+			if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0'
+						|| (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) {
+				continue;
+			}
+
+			type = entry->d_type;
+			if (type == DT_UNKNOWN) {
+				if (fstatat(fd, entry->d_name, &filestat, AT_SYMLINK_NOFOLLOW) != 0) {
+					fprintf(stderr, "OUTPUT: worker %d: Can't stat %s/%s, %d(%s)\n", mine->index, work_path(mine, work), entry->d_name, errno, strerror(errno));
+					continue;
+				}
+				type = IFTODT(filestat.st_mode);
+			}
+			if (type != DT_DIR && type != DT_REG) {
+				report_type(mine, work->job, work_path(mine, work), entry->d_name, type);
+				continue;
+			}
+
+			name_length = strlen(entry->d_name);
+			if (work->length + 1 + name_length >= path_max) {
+				fprintf(stderr, "OUTPUT: worker %d: Path too long %s/%s\n", mine->index, work_path(mine, work), entry->d_name);
+				continue;
+			}
+			new_work = pool_alloc(&crew->work_pool);
+			name = arena_alloc(&mine->arena, name_length + 1);
+			if (new_work == NULL || name == NULL) {
+				errno_abort("Allocate memory for new work");
+			}
+			memcpy(name, entry->d_name, name_length + 1);
+			new_work->name = name;
+			new_work->parent = work;
+			new_work->job = work->job;
+			new_work->refs = 1;
+			new_work->type = type;
+			new_work->fd = -1;
+			new_work->length = work->length + 1 + name_length;
+
+			team = type == DT_REG ? TEAM_FILE : TEAM_DIR;
+			batch[team][count[team]++] = new_work;
+			if (count[team] == PUSH_BATCH) {
+				// the directory's item is alive while its own reference is held
+				__atomic_add_fetch(&work->refs, count[team], __ATOMIC_RELAXED);
+				crew_push(mine, batch[team], count[team], team, 0);
+				count[team] = 0;
+			}
+		}
+	}
+	if (size < 0) {
+		fprintf(stderr, "OUTPUT: worker %d: Can't read directory %s, %d(%s)\n", mine->index, work_path(mine, work), errno, strerror(errno));
+	}
+
+	// the directory's work is counted until its entries are
+	for (team = 0; team < 2; ++team) {
+		if (count[team] > 0) {
+			__atomic_add_fetch(&work->refs, count[team], __ATOMIC_RELAXED);
+			crew_push(mine, batch[team], count[team], team, 0);
+		}
+	}
+	if (work->fd < 0) {
+		close(fd);
+	}
+}
+
+void *worker_routine(void *arg)
+{
+	worker_p mine = (worker_p)arg;
+	work_p work;
+	crew_p crew = mine->crew;
+	struct stat filestat;
+
+	int status;
+	char *block, *buffer;
+	ac_match_t match;
+
+	job_p job;
+	int room = -1;
+
+	// directory entries, getdents64 needs no room for a d_name of name_max
+	buffer = malloc(DIRENT_BATCH);
+	if (buffer == NULL) {
+		errno_abort("Allocate memory for directory entries");
+	}
+
+	mine->path = malloc(path_max);
+	if (mine->path == NULL) {
+		errno_abort("Allocate memory for path");
+	}
+
+	// page aligned reads go to block + SCAN_KEEP
+	status = posix_memalign((void **)&block, 4096, SCAN_KEEP + SCAN_BLOCK);
+	if (status != 0) {
+		err_abort(status, "Allocate memory for file block");
+	}
+
+#ifdef DEBUG
+	// stderr, so stdout has only the output of the searches, for the machine readable formats
+	fprintf(stderr, "worker %d: start to work\n", mine->index);
+#endif
+
+
+	// own newest work first, then jobs from crew_start, then the oldest work of others,
+	// parked in between, until crew_destroy finds no jobs left and tells workers to exit
+	while (1) {
+		work = deque_pop(&mine->deque[mine->team]);
+		if (work == NULL && mine->team == TEAM_DIR) {
+			work = crew_take(crew);
+		}
+		if (work == NULL) {
+			work = crew_steal(mine);
+		}
+		if (work == NULL) {
+			crew_flush(mine);
+			if (__atomic_load_n(&crew->shutdown, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+			crew_park(mine);
+			continue;
+		}
+		++mine->items;
+		job = work->job;
+
+		// the last job's output and counts go before anything of another
+		if (job != mine->job) {
+			crew_flush(mine);
+			mine->job = job;
+			if (mine->output == NULL && crew->output_size > 0) {
+				mine->output = malloc(crew->output_size);
+				if (mine->output == NULL) {
+					errno_abort("Allocate memory for output");
+				}
+			}
+		}
+
+		// precess work item, only the start path has no type from its directory, and its name is its path
+		if (work->type == DT_UNKNOWN) {
+			status = lstat(work->name, &filestat);
+			if (status != 0) {
+				fprintf(stderr, "OUTPUT: worker %d: Can't stat %s, %d(%s)\n", mine->index, work->name, errno, strerror(errno));
+				crew_finish(mine, work);
+				continue;
+			}
+			work->type = IFTODT(filestat.st_mode);
+		}
+
+		// a regular file given to crew_start, pass it on to the file team
+		if (work->type == DT_REG && mine->team == TEAM_DIR) {
+			crew_push(mine, &work, 1, TEAM_FILE, 1);
+			continue;
+		}
+
+		// room for the patterns of the largest job yet
+		if (job->patterns != NULL && job->patterns->patterns > room) {
+			if (room >= 0) {
+				ac_match_destroy(&match);
+			}
+			ac_match_init(&match, job->patterns);
+			room = job->patterns->patterns;
+		}
+
+		if (work->type == DT_DIR) {
+			crew_walk(mine, work, buffer);
+		} else if (work->type == DT_REG) {
+			scan_file(mine, work, block, &match);
+		} else if (work->type == DT_CHUNK) {
+			scan_chunk(mine, work, block, &match);
+		} else {
+			report_type(mine, job, work->name, NULL, work->type);
+		}
+
+		crew_finish(mine, work);
+	}
+
+#ifdef DEBUG
+	fprintf(stderr, "worker %d: done, %ld items, %ld steals\n", mine->index, mine->items, mine->steals);
+#endif
+	if (room >= 0) {
+		ac_match_destroy(&match);
+	}
+	// chunks of names still in use go with their last name
+	arena_destroy(&mine->arena);
+	free(block);
+	free(buffer);
+	free(mine->path);
+	return NULL;
+}
+
+/* split size workers into teams, a quarter of them enumerate, the rest scan */
+void crew_split(int size, int *dirs, int *files)
+{
+	*dirs = (size + 3) / 4;
+	*files = size - *dirs > 1 ? size - *dirs : 1;
+}
+
+// get the path limit and set up work_pool
+int crew_pool_init(crew_p crew)
+{
+	errno = 0;
+	path_max = pathconf("/", _PC_PATH_MAX);
+	if (path_max == -1) {
+		if (errno == 0) {
+			path_max = 1024;
+		}
+		else {
+			errno_abort("Unable to get _PC_PATH_MAX");
+		}
+	}
+
+	// plus 1 for terminal '\0'
+	++path_max;
+
+	return pool_init(&crew->work_pool, "work_t", sizeof(work_t));
+}
+
+/*
+ * start dirs directory workers and files file workers, 0 for a default
+ * share of the online CPUs, pin them to the CPUs the process may run on
+ * when pin is set, file workers first, as they are the CPU bound ones
+ */
+int create_crew(crew_p crew, int dirs, int files, int pin)
+{
+	int status, i, cpus, team, split_dirs, split_files;
+	struct rlimit limit;
+	cpu_set_t allowed, set;
+	int *cpu;
+	pthread_attr_t attr;
+
+	if (dirs < 0 || files < 0) {
+		return EINVAL;
+	}
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) {
+		cpus = 1;
+	}
+	crew_split(cpus, &split_dirs, &split_files);
+	if (dirs == 0) {
+		dirs = split_dirs;
+	}
+	if (files == 0) {
+		files = split_files;
+	}
+
+	crew->crew_size = dirs + files;
+	crew->team[TEAM_DIR].size = dirs;
+	crew->team[TEAM_FILE].size = files;
+	crew->jobs = 0;
+	crew->first = crew->last = NULL;
+	crew->shutdown = 0;
+	crew->io_mode = IO_AUTO;
+	crew->output_size = OUTPUT_SIZE;
+	// the rest for the files the workers search and the caller's own
+	crew->dir_fds = 0;
+	crew->dir_fd_max = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+		? limit.rlim_cur / 2 : 512;
+
+	// path_max sizes the workers' path buffers
+	status = crew_pool_init(crew);
+	if (status != 0) {
+		return status;
+	}
+
+	// align for cache line aligned deques
+	status = posix_memalign((void **)&crew->worker, CACHE_LINE, crew->crew_size * sizeof(worker_t));
+	if (status != 0) {
+		return status;
+	}
+
+	status = pthread_mutex_init(&crew->mutex, NULL);
+	if (status != 0) {
+		return status;
+	}
+	for (team = 0; team < 2; ++team) {
+		crew->team[team].idle = 0;
+		crew->team[team].items = crew->team[team].steals = crew->team[team].parks = 0;
+		crew->team[team].writes = 0;
+		status = pthread_cond_init(&crew->team[team].go, NULL);
+		if (status != 0) {
+			return status;
+		}
+	}
+	status = pthread_cond_init(&crew->done, NULL);
+	if (status != 0) {
+		return status;
+	}
+
+	// CPUs the process may run on, in order
+	cpu = malloc(CPU_SETSIZE * sizeof(int));
+	if (cpu == NULL) {
+		errno_abort("Allocate memory for CPU list");
+	}
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		errno_abort("Get CPU affinity");
+	}
+	for (cpus = i = 0; i < CPU_SETSIZE; ++i) {
+		if (CPU_ISSET(i, &allowed)) {
+			cpu[cpus++] = i;
+		}
+	}
+
+	// all deques are set up before any worker may steal from them
+	for (i = 0; i < crew->crew_size; ++i) {
+		crew->worker[i].index = i;
+		crew->worker[i].team = i < dirs ? TEAM_DIR : TEAM_FILE;
+		crew->worker[i].cpu = -1;
+		if (pin) {
+			// file worker k on the k-th CPU, directory workers on the CPUs after them
+			crew->worker[i].cpu = cpu[(i < dirs ? files + i : i - dirs) % cpus];
+		}
+		crew->worker[i].crew = crew;
+		crew->worker[i].seed = i + 1;
+		crew->worker[i].items = crew->worker[i].steals = crew->worker[i].parks = 0;
+		crew->worker[i].writes = 0;
+		crew->worker[i].job = NULL;
+		crew->worker[i].output = NULL;
+		crew->worker[i].output_length = 0;
+		crew->worker[i].done = crew->worker[i].matches = 0;
+		arena_init(&crew->worker[i].arena);
+		deque_init(&crew->worker[i].deque[TEAM_DIR]);
+		deque_init(&crew->worker[i].deque[TEAM_FILE]);
+	}
+	free(cpu);
+
+	for (i = 0; i < crew->crew_size; ++i) {
+		status = pthread_attr_init(&attr);
+		if (status != 0) {
+			err_abort(status, "Init worker attr");
+		}
+		if (crew->worker[i].cpu >= 0) {
+			CPU_ZERO(&set);
+			CPU_SET(crew->worker[i].cpu, &set);
+			status = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+			if (status != 0) {
+				err_abort(status, "Set worker affinity");
+			}
+		}
+		status = pthread_create(&crew->worker[i].thread, &attr, worker_routine, &crew->worker[i]);
+		if (status != 0) {
+			err_abort(status, "Create worker");
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	return 0;
+}
+
+/*
+ * start a search of path for search, or for patterns unless NULL, with
+ * what is found printed to output in format, and return without waiting
+ * for it, job is the handle for crew_wait, path and search MUST stay
+ * until then
+ */
+int crew_start(crew_p crew, job_p job, const char *path, const char *search,
+		const ac_t *patterns, FILE *output, int format)
+{
+	int status, i;
+	work_p work;
+
+	// a block keeps length - 1 bytes of the previous one
+	if (strlen(search) > SCAN_KEEP) {
+		return EINVAL;
+	}
+	if (strlen(path) >= path_max) {
+		return ENAMETOOLONG;
+	}
+
+	job->next = NULL;
+	job->search = search;
+	job->patterns = patterns;
+	job->output = output;
+	job->format = format;
+	job->overlap = strlen(search) > 0 ? strlen(search) - 1 : 0;
+	if (patterns != NULL) {
+		for (i = 0; i < patterns->patterns; ++i) {
+			if (patterns->length[i] > job->overlap + 1) {
+				job->overlap = patterns->length[i] - 1;
+			}
+		}
+	}
+	job->work_count = 1;
+	job->matches = 0;
+	job->finished = 0;
+	status = pthread_cond_init(&job->done, NULL);
+	if (status != 0) {
+		return status;
+	}
+
+	work = pool_alloc(&crew->work_pool);
+	if (work == NULL) {
+		errno_abort("Allocate memory for new work");
+	}
+	work->name = path;
+	work->parent = NULL;
+	work->job = job;
+	work->refs = 1;
+	work->type = DT_UNKNOWN;
+	work->fd = -1;
+	work->length = strlen(path);
+	job->root = work;
+
+	status = pthread_mutex_lock(&crew->mutex);
+	if (status != 0) {
+		err_abort(status, "Lock crew mutex");
+	}
+	// directory workers look at first without the mutex
+	if (crew->first == NULL) {
+		__atomic_store_n(&crew->first, job, __ATOMIC_RELAXED);
+	}
+	else {
+		crew->last->next = job;
+	}
+	crew->last = job;
+	++crew->jobs;
+
+	// one directory worker takes the start path, the others steal what it finds
+	status = pthread_cond_signal(&crew->team[TEAM_DIR].go);
+	if (status != 0) {
+		err_abort(status, "Signal go cond for new job");
+	}
+	status = pthread_mutex_unlock(&crew->mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock crew mutex");
+	}
+	return 0;
+}
+
+/* wait until job is done, once for each crew_start, then job may be freed */
+int crew_wait(crew_p crew, job_p job)
+{
+	int status;
+
+	status = pthread_mutex_lock(&crew->mutex);
+	if (status != 0) {
+		return status;
+	}
+	while (!job->finished) {
+		status = pthread_cond_wait(&job->done, &crew->mutex);
+		if (status != 0) {
+			pthread_mutex_unlock(&crew->mutex);
+			return status;
+		}
+	}
+	status = pthread_mutex_unlock(&crew->mutex);
+	if (status != 0) {
+		return status;
+	}
+	return pthread_cond_destroy(&job->done);
+}
+
+/*
+ * wait until the jobs started are done, tell the idle workers to exit,
+ * join them, sum their counters into their teams, and free them and the
+ * work items
+ */
+void crew_destroy(crew_p crew)
+{
+	int status, i;
+	worker_p worker;
+	team_t *team;
+
+	status = pthread_mutex_lock(&crew->mutex);
+	if (status != 0) {
+		err_abort(status, "Lock crew mutex");
+	}
+	while (crew->jobs > 0) {
+		status = pthread_cond_wait(&crew->done, &crew->mutex);
+		if (status != 0) {
+			err_abort(status, "Wait on cond crew done");
+		}
+	}
+	__atomic_store_n(&crew->shutdown, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < 2; ++i) {
+		status = pthread_cond_broadcast(&crew->team[i].go);
+		if (status != 0) {
+			err_abort(status, "Broadcast go cond");
+		}
+	}
+	status = pthread_mutex_unlock(&crew->mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock crew mutex");
+	}
+
+	for (i = 0; i < crew->crew_size; ++i) {
+		worker = &crew->worker[i];
+		status = pthread_join(worker->thread, NULL);
+		if (status != 0) {
+			err_abort(status, "Join worker");
+		}
+		team = &crew->team[worker->team];
+		team->items += worker->items;
+		team->steals += worker->steals;
+		team->parks += worker->parks;
+		team->writes += worker->writes;
+	}
+	// workers still running may steal from the deques of those joined
+	for (i = 0; i < crew->crew_size; ++i) {
+		deque_destroy(&crew->worker[i].deque[TEAM_DIR]);
+		deque_destroy(&crew->worker[i].deque[TEAM_FILE]);
+		free(crew->worker[i].output);
+	}
+	free(crew->worker);
+	crew->worker = NULL;
+
+	for (i = 0; i < 2; ++i) {
+		pthread_cond_destroy(&crew->team[i].go);
+	}
+	pthread_cond_destroy(&crew->done);
+	pthread_mutex_destroy(&crew->mutex);
+	pool_destroy(&crew->work_pool);
+}
+
+/*
+ * Make a tree of files files under root for the benchmark, 100 files to
+ * a directory and 100 directories to a parent, unless root exists.
+ */
+void make_tree(const char *root, long files)
+{
+	char path[1024];
+	long i;
+	FILE *file;
+
+	if (mkdir(root, 0755) != 0) {
+		if (errno == EEXIST) {
+			return;
+		}
+		errno_abort("Make benchmark tree");
+	}
+	for (i = 0; i < files; ++i) {
+		if (i % 10000 == 0) {
+			snprintf(path, sizeof(path), "%s/%ld", root, i / 10000);
+			if (mkdir(path, 0755) != 0) {
+				errno_abort("Make benchmark directory");
+			}
+		}
+		if (i % 100 == 0) {
+			snprintf(path, sizeof(path), "%s/%ld/%ld", root, i / 10000, i / 100 % 100);
+			if (mkdir(path, 0755) != 0) {
+				errno_abort("Make benchmark directory");
+			}
+		}
+		snprintf(path, sizeof(path), "%s/%ld/%ld/%ld", root, i / 10000, i / 100 % 100, i % 100);
+		file = fopen(path, "w");
+		if (file == NULL) {
+			errno_abort("Make benchmark file");
+		}
+		fprintf(file, "file %ld\n", i);
+		fclose(file);
+	}
+}
+
+/*
+ * Search a tree of files small files for a string none of them has with
+ * crews of 1 to 64 workers split into teams like the default crew, and
+ * print entries per second, the speedup over the smallest crew, how
+ * often workers of each team stole and parked, and the peak RSS so far.
+ */
+void benchmark(long files, int pin)
+{
+	int status, size, dirs, scanners;
+	char root[64];
+	crew_t crew;
+	team_t *team;
+	job_t job;
+	struct timespec start, end;
+	struct rusage usage;
+	double seconds, base = 0;
+
+	snprintf(root, sizeof(root), "/tmp/crew_tree_%ld", files);
+	make_tree(root, files);
+
+	for (size = 1; size <= CREW_SIZE; size *= 2) {
+		crew_split(size, &dirs, &scanners);
+		status = create_crew(&crew, dirs, scanners, pin);
+		if (status != 0) {
+			err_abort(status, "Create crew");
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		status = crew_start(&crew, &job, root, "no such string", NULL, stdout, FORMAT_TEXT);
+		if (status != 0) {
+			err_abort(status, "Crew start");
+		}
+		status = crew_wait(&crew, &job);
+		if (status != 0) {
+			err_abort(status, "Crew wait");
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		crew_destroy(&crew);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		if (size == 1) {
+			base = seconds;
+		}
+
+		team = crew.team;
+		getrusage(RUSAGE_SELF, &usage);
+		printf("%2d+%-2d workers: %ld entries in %.3fs, %8.0f entries/s, speedup %.2f, "
+				"%ld+%ld steals, %ld+%ld parks, peak RSS %ld MB\n",
+				dirs, scanners, team[TEAM_DIR].items + team[TEAM_FILE].items, seconds,
+				(team[TEAM_DIR].items + team[TEAM_FILE].items) / seconds, base / seconds,
+				team[TEAM_DIR].steals, team[TEAM_FILE].steals, team[TEAM_DIR].parks, team[TEAM_FILE].parks,
+				usage.ru_maxrss / 1024);
+	}
+}
+
+/*
+ * Search the 100 file directories of the 100000 file tree, searches of
+ * them in all, with a new crew for each search, with one crew a search
+ * after another, and with one crew all at once, and print searches per
+ * second. Every file has the search string, so each search must find
+ * 100 matches, printed to /dev/null.
+ */
+void job_benchmark(long searches, int pin)
+{
+	int status, method;
+	long i, errors;
+	char root[64], (*path)[128];
+	crew_t crew;
+	job_t *job;
+	FILE *output;
+	struct timespec start, end;
+	double seconds;
+	const char *names[] = {"crew per search", "one crew, in turn", "one crew, at once"};
+
+	snprintf(root, sizeof(root), "/tmp/crew_tree_%d", 100000);
+	make_tree(root, 100000);
+	output = fopen("/dev/null", "w");
+	job = malloc(searches * sizeof(job_t));
+	path = malloc(searches * sizeof(*path));
+	if (output == NULL || job == NULL || path == NULL) {
+		errno_abort("Set up job benchmark");
+	}
+	for (i = 0; i < searches; ++i) {
+		snprintf(path[i], sizeof(path[i]), "%s/%ld/%ld", root, i / 100 % 10, i % 100);
+	}
+
+	for (method = 0; method < 3; ++method) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (method > 0) {
+			status = create_crew(&crew, 0, 0, pin);
+			if (status != 0) {
+				err_abort(status, "Create crew");
+			}
+		}
+		for (i = 0; i < searches; ++i) {
+			if (method == 0) {
+				status = create_crew(&crew, 0, 0, pin);
+				if (status != 0) {
+					err_abort(status, "Create crew");
+				}
+			}
+			status = crew_start(&crew, &job[i], path[i], "file ", NULL, output, FORMAT_TEXT);
+			if (status != 0) {
+				err_abort(status, "Crew start");
+			}
+			if (method < 2) {
+				status = crew_wait(&crew, &job[i]);
+				if (status != 0) {
+					err_abort(status, "Crew wait");
+				}
+			}
+			if (method == 0) {
+				crew_destroy(&crew);
+			}
+		}
+		if (method == 2) {
+			for (i = 0; i < searches; ++i) {
+				status = crew_wait(&crew, &job[i]);
+				if (status != 0) {
+					err_abort(status, "Crew wait");
+				}
+			}
+		}
+		if (method > 0) {
+			crew_destroy(&crew);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+		for (errors = i = 0; i < searches; ++i) {
+			errors += job[i].matches != 100;
+		}
+		printf("%-18s %ld searches in %.3fs, %8.0f searches/s%s\n", names[method], searches,
+				seconds, searches / seconds, errors == 0 ? "" : ", BAD RESULTS");
+	}
+	free(path);
+	free(job);
+	fclose(output);
+}
+
+const char *format_names[] = {"text", "nul", "json"};
+
+/*
+ * Search a tree of files small files for a string all of them have, so
+ * every file is a match, printed to /dev/null, with crews of 1 to 64
+ * workers, each line written to the stream at once as crew used to, and
+ * through the workers' buffers in each format, and print matches per
+ * second and how many writes to the stream it took.
+ */
+void output_benchmark(long files, int pin)
+{
+	int status, size, dirs, scanners, method, format;
+	char root[64];
+	crew_t crew;
+	job_t job;
+	FILE *output;
+	struct timespec start, end;
+	double seconds;
+
+	snprintf(root, sizeof(root), "/tmp/crew_tree_%ld", files);
+	make_tree(root, files);
+	output = fopen("/dev/null", "w");
+	if (output == NULL) {
+		errno_abort("Open /dev/null");
+	}
+
+	for (size = 1; size <= CREW_SIZE; size *= 4) {
+		crew_split(size, &dirs, &scanners);
+		// unbuffered text, then buffered in each format
+		for (method = 0; method <= FORMAT_JSON + 1; ++method) {
+			format = method > 0 ? method - 1 : FORMAT_TEXT;
+			status = create_crew(&crew, dirs, scanners, pin);
+			if (status != 0) {
+				err_abort(status, "Create crew");
+			}
+			if (method == 0) {
+				crew.output_size = 0;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			status = crew_start(&crew, &job, root, "file ", NULL, output, format);
+			if (status != 0) {
+				err_abort(status, "Crew start");
+			}
+			status = crew_wait(&crew, &job);
+			if (status != 0) {
+				err_abort(status, "Crew wait");
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			crew_destroy(&crew);
+			seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+			printf("%2d+%-2d workers, %-4s %-8s: %ld matches in %.3fs, %8.0f matches/s, %ld writes%s\n",
+					dirs, scanners, format_names[format], method == 0 ? "per line" : "buffered",
+					job.matches, seconds, job.matches / seconds,
+					crew.team[TEAM_DIR].writes + crew.team[TEAM_FILE].writes,
+					job.matches == files ? "" : ", BAD RESULTS");
+		}
+	}
+	fclose(output);
+}
+
+// entries and stat calls of a walk
+typedef struct walk_tag {
+	long				entries;
+	long				stats;
+}walk_t;
+
+/* walk path the way crew did, readdir, then a path built and lstat for each entry */
+void walk_readdir(const char *path, walk_t *walk)
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct stat filestat;
+	char child[1024];
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		errno_abort("Open benchmark directory");
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+		++walk->entries;
+		++walk->stats;
+		if (lstat(child, &filestat) != 0) {
+			errno_abort("lstat benchmark entry");
+		}
+		if (S_ISDIR(filestat.st_mode)) {
+			walk_readdir(child, walk);
+		}
+	}
+	closedir(dir);
+}
+
+/* walk the directory fd the way crew_walk does, getdents64 batches, d_type and openat */
+void walk_getdents(int fd, walk_t *walk)
+{
+	struct dirent64 *entry;
+	struct stat filestat;
+	char *buffer;
+	ssize_t size, offset;
+	int type, child;
+
+	buffer = malloc(DIRENT_BATCH);
+	if (buffer == NULL) {
+		errno_abort("Allocate memory for directory entries");
+	}
+	while ((size = getdents64(fd, buffer, DIRENT_BATCH)) > 0) {
+		for (offset = 0; offset < size; offset += entry->d_reclen) {
+			entry = (struct dirent64 *)(buffer + offset);
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+				continue;
+			}
+			++walk->entries;
+			type = entry->d_type;
+			if (type == DT_UNKNOWN) {
+				++walk->stats;
+				if (fstatat(fd, entry->d_name, &filestat, AT_SYMLINK_NOFOLLOW) != 0) {
+					errno_abort("fstatat benchmark entry");
+				}
+				type = IFTODT(filestat.st_mode);
+			}
+			if (type == DT_DIR) {
+				child = openat(fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+				if (child < 0) {
+					errno_abort("Open benchmark directory");
+				}
+				walk_getdents(child, walk);
+				close(child);
+			}
+		}
+	}
+	if (size < 0) {
+		errno_abort("Read benchmark directory");
+	}
+	free(buffer);
+}
+
+/*
+ * Walk a tree of files small files on one thread, with readdir and an
+ * lstat per entry, then with getdents64, and print entries per second
+ * and stat calls. Each walk runs twice and the second, with the inodes
+ * and dentries cached, is timed, so it is the system calls that count.
+ */
+void walk_benchmark(long files)
+{
+	char root[64];
+	int pass, method, fd;
+	walk_t walk;
+	struct timespec start, end;
+	double seconds;
+
+	snprintf(root, sizeof(root), "/tmp/crew_tree_%ld", files);
+	make_tree(root, files);
+
+	for (method = 0; method < 2; ++method) {
+		for (pass = 0; pass < 2; ++pass) {
+			walk.entries = walk.stats = 0;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (method == 0) {
+				walk_readdir(root, &walk);
+			} else {
+				fd = open(root, O_RDONLY | O_DIRECTORY);
+				if (fd < 0) {
+					errno_abort("Open benchmark tree");
+				}
+				walk_getdents(fd, &walk);
+				close(fd);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+		}
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%-18s %ld entries in %.3fs, %9.0f entries/s, %ld stat calls\n",
+				method == 0 ? "readdir+lstat" : "getdents64+d_type",
+				walk.entries, seconds, walk.entries / seconds, walk.stats);
+	}
+}
+
+/* search the whole of block with the per line fgets and strstr path crew used before */
+long search_lines(char *block, size_t size, const char *needle)
+{
+	FILE *file;
+	char buffer[256];
+	long offset = -1;
+
+	file = fmemopen(block, size, "r");
+	if (file == NULL) {
+		errno_abort("Open block as stream");
+	}
+	while (fgets(buffer, sizeof(buffer), file) != NULL) {
+		if (strstr(buffer, needle) != NULL) {
+			offset = ftell(file);
+			break;
+		}
+	}
+	fclose(file);
+	return offset;
+}
+
+/* size bytes of lowercase words in lines of about 64 bytes, NUL terminated */
+char *text_block(size_t size)
+{
+	char *block;
+	size_t i;
+	unsigned int seed = 1;
+	int k;
+
+	block = malloc(size + 1);
+	if (block == NULL) {
+		errno_abort("Allocate memory for search block");
+	}
+	for (i = 0; i < size; ++i) {
+		k = rand_r(&seed) % 128;
+		block[i] = k < 2 ? '\n' : k < 20 ? ' ' : 'a' + k % 26;
+	}
+	block[size] = '\0';
+	return block;
+}
+
+/*
+ * Search megabytes of text lines in a 64MB block for a string found only
+ * at the end of it, with the fgets and strstr path and with each kernel,
+ * and print GB/s. Kernels are also checked against each other on
+ * matches at every offset across a vector width.
+ */
+void search_benchmark(long megabytes)
+{
+	size_t size = 64 * 1024 * 1024, i, length;
+	char *block, needle[] = "no such string";
+	long passes, pass, offset, errors = 0;
+	int k, shift;
+	struct timespec start, end;
+	double seconds;
+	const char *found[4];
+	struct {
+		const char		*name;
+		search_kernel_t		kernel;
+	} kernels[4] = {
+		{"scalar", search_scalar},
+#ifdef SEARCH_X86
+		{"sse2", search_sse2},
+		{"avx2", search_avx2},
+#endif
+	};
+	int count = 1;
+
+#ifdef SEARCH_X86
+	count = __builtin_cpu_supports("avx2") ? 3 : 2;
+#endif
+	length = strlen(needle);
+	passes = megabytes / 64 > 0 ? megabytes / 64 : 1;
+
+	// the needle only at the end
+	block = text_block(size);
+	memcpy(block + size - 64, needle, length);
+	block[size] = '\0';
+
+	// every kernel finds the needle at every offset, in a block of every size around it
+	for (shift = 0; shift < 80; ++shift) {
+		for (k = 0; k < count; ++k) {
+			found[k] = kernels[k].kernel(block + size - 64 - shift, 64 + shift - (shift % 7), needle, length);
+			if (found[k] != block + size - 64) {
+				++errors;
+			}
+		}
+	}
+
+	// picks the kernel
+	search_block(block, 0, needle, length);
+	printf("searching %ld MB, %s kernel picked%s\n", passes * 64, search_kernel_name,
+			errors == 0 ? "" : ", BAD RESULTS");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (pass = 0; pass < passes; ++pass) {
+		offset = search_lines(block, size, needle);
+		if (offset < (long)(size - 64)) {
+			++errors;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-14s %6.2f GB/s\n", "fgets+strstr", passes * size / seconds / 1e9);
+
+	for (k = 0; k < count; ++k) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (pass = 0; pass < passes; ++pass) {
+			// in SCAN_BLOCK blocks, overlapping like crew's file scan
+			for (i = 0; i < size; i += SCAN_BLOCK - (length - 1)) {
+				found[0] = kernels[k].kernel(block + i, i + SCAN_BLOCK < size ? SCAN_BLOCK : size - i,
+						needle, length);
+				if (found[0] != NULL) {
+					break;
+				}
+			}
+			if (found[0] != block + size - 64) {
+				++errors;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%-14s %6.2f GB/s%s\n", kernels[k].name, passes * size / seconds / 1e9,
+				errors == 0 ? "" : ", BAD RESULTS");
+	}
+	free(block);
+}
+
+/* add a pattern per line of path to ac, skipping empty lines, and compile it */
+int load_patterns(ac_t *ac, const char *path)
+{
+	FILE *file;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t length;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		return errno;
+	}
+	ac_init(ac);
+	while ((length = getline(&line, &size, file)) > 0) {
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+			--length;
+		}
+		if (length > 0) {
+			ac_add(ac, line, length);
+		}
+	}
+	free(line);
+	fclose(file);
+	ac_compile(ac);
+	return 0;
+}
+
+/*
+ * Scan megabytes of text in a 64MB block for 1 to 10000 random patterns
+ * in one pass each, the first few planted at the end, and print GB/s
+ * against searching for the patterns one by one, which is estimated
+ * from a search_block pass per pattern.
+ */
+void pattern_benchmark(long megabytes)
+{
+	size_t size = 64 * 1024 * 1024;
+	char *block, pattern[32];
+	unsigned int seed = 2;
+	long passes, pass;
+	int count, i, length, planted, state, errors = 0;
+	ac_t ac;
+	ac_match_t match;
+	struct timespec start, end;
+	double seconds, build, single;
+
+	passes = megabytes / 64 > 0 ? megabytes / 64 : 1;
+	block = text_block(size);
+
+	// a pass of the fastest single string search, with no match
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (pass = 0; pass < passes; ++pass) {
+		if (search_block(block, size, "no such string", 14) != NULL) {
+			++errors;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	single = ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9) / passes;
+
+	for (count = 1; count <= 10000; count *= 10) {
+		// letters, 8 to 16 of them, unlikely to be in random text
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ac_init(&ac);
+		planted = count < 4 ? count : 4;
+		for (i = 0; i < count; ++i) {
+			length = 8 + rand_r(&seed) % 9;
+			for (pattern[length] = '\0'; length-- > 0; ) {
+				pattern[length] = 'a' + rand_r(&seed) % 26;
+			}
+			ac_add(&ac, pattern, strlen(pattern));
+			if (i < planted) {
+				memcpy(block + size - 64 * (i + 1), pattern, strlen(pattern));
+			}
+		}
+		ac_compile(&ac);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		build = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		ac_match_init(&match, &ac);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (pass = 0; pass < passes; ++pass) {
+			state = 0;
+			ac_scan(&ac, &state, block, size, &match);
+			if (match.count != planted) {
+				++errors;
+			}
+			ac_match_reset(&match);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+		printf("%5d patterns: %6d states x %2d classes, built in %.3fs, %6.2f GB/s, "
+				"one search per pattern %8.4f GB/s%s\n",
+				count, ac.states, ac.classes, build, passes * size / seconds / 1e9,
+				size / (single * count) / 1e9, errors == 0 ? "" : ", BAD RESULTS");
+		ac_match_destroy(&match);
+		ac_destroy(&ac);
+	}
+	free(block);
+}
+
+const char *io_names[] = {"auto", "stdio", "pread", "mmap"};
+
+/* drop pages of the files under path from the page cache, or read them all in */
+void cache_tree(const char *path, int drop)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char child[1024], *block;
+	int fd;
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		errno_abort("Open benchmark directory");
+	}
+	block = malloc(SCAN_BLOCK);
+	if (block == NULL) {
+		errno_abort("Allocate memory for cache block");
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+		fd = open(child, O_RDONLY);
+		if (fd < 0) {
+			errno_abort("Open benchmark file");
+		}
+		if (drop) {
+			// only clean pages can be dropped
+			fdatasync(fd);
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		} else {
+			while (read(fd, block, SCAN_BLOCK) > 0) {
+				;
+			}
+		}
+		close(fd);
+	}
+	free(block);
+	closedir(dir);
+}
+
+/*
+ * Search megabytes of files from 4KB to 16MB, the same bytes in each size,
+ * in each I/O mode with the page cache hot and cold, and print MB/s.
+ * Cold drops the files' pages with POSIX_FADV_DONTNEED, which needs no
+ * privileges, but other caches below it, like a host's, stay warm.
+ */
+void io_benchmark(long megabytes, int pin)
+{
+	int status, mode, cold, shift, fd, create;
+	long i, count, size, bytes;
+	char root[64], path[1024], *data;
+	crew_t crew;
+	job_t job;
+	struct timespec start, end;
+	double seconds;
+	struct stat filestat;
+
+	snprintf(root, sizeof(root), "/tmp/crew_io_%ld", megabytes);
+	create = stat(root, &filestat) != 0;
+	if (create && mkdir(root, 0755) != 0) {
+		errno_abort("Make benchmark tree");
+	}
+	data = malloc(16 << 20);
+	if (data == NULL) {
+		errno_abort("Allocate memory for benchmark file");
+	}
+	for (i = 0; i < 16 << 20; ++i) {
+		data[i] = i % 61 == 60 ? '\n' : 'a' + i % 26;
+	}
+	// 4KB to 16MB files, megabytes / 13 of each size
+	for (bytes = 0, shift = 12; shift <= 24; ++shift) {
+		size = 1L << shift;
+		count = (megabytes << 20) / 13 / size;
+		for (i = 0; i < (count > 0 ? count : 1); ++i, bytes += size) {
+			if (!create) {
+				continue;
+			}
+			snprintf(path, sizeof(path), "%s/%ld_%ld", root, size, i);
+			fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0 || write(fd, data, size) != size) {
+				errno_abort("Write benchmark file");
+			}
+			close(fd);
+		}
+	}
+	free(data);
+
+	for (cold = 0; cold <= 1; ++cold) {
+		for (mode = IO_AUTO; mode <= IO_MMAP; ++mode) {
+			cache_tree(root, cold);
+			status = create_crew(&crew, 0, 0, pin);
+			if (status != 0) {
+				err_abort(status, "Create crew");
+			}
+			crew.io_mode = mode;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			status = crew_start(&crew, &job, root, "no such string", NULL, stdout, FORMAT_TEXT);
+			if (status != 0) {
+				err_abort(status, "Crew start");
+			}
+			status = crew_wait(&crew, &job);
+			if (status != 0) {
+				err_abort(status, "Crew wait");
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			crew_destroy(&crew);
+			seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+			printf("%-5s %s cache: %ld files, %8.1f MB/s\n", io_names[mode], cold ? "cold" : "hot ",
+					crew.team[TEAM_FILE].items, bytes / seconds / (1 << 20));
+		}
+	}
+}
+
+/*
+ * Search one file of megabytes with 1, 2, 4 and 8 file workers, for a
+ * string it doesn't have, so every chunk is read, and for one across the
+ * chunk boundary in its middle, so chunks after it are cancelled, and
+ * print GB/s of the file size. The file is read into the page cache
+ * first, so the split shows on CPU, not disk.
+ */
+void split_benchmark(long megabytes, int pin)
+{
+	const char *needle = "split needle";
+	int status, fd, files, plant;
+	long i, size = megabytes << 20, middle;
+	char path[64], *data, *block;
+	crew_t crew;
+	job_t job;
+	FILE *output;
+	struct timespec start, end;
+	double seconds;
+	struct stat filestat;
+
+	snprintf(path, sizeof(path), "/tmp/crew_split_%ld", megabytes);
+	middle = size / CHUNK_SIZE / 2 * CHUNK_SIZE - strlen(needle) / 2;
+	if (stat(path, &filestat) != 0 || filestat.st_size != size) {
+		data = malloc(CHUNK_SIZE);
+		if (data == NULL) {
+			errno_abort("Allocate memory for benchmark file");
+		}
+		for (i = 0; i < CHUNK_SIZE; ++i) {
+			data[i] = i % 61 == 60 ? '\n' : 'a' + i % 26;
+		}
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			errno_abort("Create benchmark file");
+		}
+		for (i = 0; i < size; i += CHUNK_SIZE) {
+			if (write(fd, data, size - i < CHUNK_SIZE ? size - i : CHUNK_SIZE) < 0) {
+				errno_abort("Write benchmark file");
+			}
+		}
+		close(fd);
+		free(data);
+	}
+	output = fopen("/dev/null", "w");
+	block = malloc(SCAN_BLOCK);
+	if (output == NULL || block == NULL) {
+		errno_abort("Open benchmark output");
+	}
+
+	for (plant = 0; plant <= 1; ++plant) {
+		// the needle goes in for the second pass, and out again
+		fd = open(path, O_WRONLY);
+		if (fd < 0 || pwrite(fd, plant ? needle : "abcdefghijkl", strlen(needle), middle) < 0) {
+			errno_abort("Plant needle in benchmark file");
+		}
+		close(fd);
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			errno_abort("Open benchmark file");
+		}
+		while (read(fd, block, SCAN_BLOCK) > 0) {
+			;
+		}
+		close(fd);
+		for (files = 1; files <= 8; files *= 2) {
+			status = create_crew(&crew, 1, files, pin);
+			if (status != 0) {
+				err_abort(status, "Create crew");
+			}
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			status = crew_start(&crew, &job, path, needle, NULL, output, FORMAT_TEXT);
+			if (status != 0) {
+				err_abort(status, "Crew start");
+			}
+			status = crew_wait(&crew, &job);
+			if (status != 0) {
+				err_abort(status, "Crew wait");
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			crew_destroy(&crew);
+			seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+			printf("%s: %d file workers, %ld chunks, %ld matches, %6.2f GB/s\n",
+					plant ? "match in middle" : "no match       ", files, crew.team[TEAM_FILE].items - 1,
+					job.matches, size / seconds / (1 << 30));
+			if (job.matches != plant) {
+				fprintf(stderr, "Expected %d matches, found %ld\n", plant, job.matches);
+				exit(1);
+			}
+		}
+	}
+	fclose(output);
+	free(block);
+}
+
+int main(int argc, char **argv)
+{
+	int status, i, dirs = 0, files = 0, pin = 0, mode = IO_AUTO, format = FORMAT_TEXT;
+	char *patterns = NULL;
+	crew_t crew;
+	job_t job;
+	ac_t ac;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+		if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			dirs = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			files = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-p") == 0) {
+			pin = 1;
+		} else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			++i;
+			for (mode = IO_MMAP; mode >= IO_AUTO && strcmp(argv[i], io_names[mode]) != 0; --mode) {
+				;
+			}
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			++i;
+			for (format = FORMAT_JSON; format >= FORMAT_TEXT && strcmp(argv[i], format_names[format]) != 0; --format) {
+				;
+			}
+		} else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+			patterns = argv[++i];
+		} else if (strcmp(argv[i], "-a") == 0) {
+			pattern_benchmark(i + 1 < argc ? atol(argv[i + 1]) : 1024);
+			return 0;
+		} else if (strcmp(argv[i], "-m") == 0) {
+			io_benchmark(i + 1 < argc ? atol(argv[i + 1]) : 1024, pin);
+			return 0;
+		} else if (strcmp(argv[i], "-c") == 0) {
+			split_benchmark(i + 1 < argc ? atol(argv[i + 1]) : 2048, pin);
+			return 0;
+		} else if (strcmp(argv[i], "-b") == 0) {
+			benchmark(i + 1 < argc ? atol(argv[i + 1]) : 1000000, pin);
+			return 0;
+		} else if (strcmp(argv[i], "-r") == 0) {
+			output_benchmark(i + 1 < argc ? atol(argv[i + 1]) : 100000, pin);
+			return 0;
+		} else if (strcmp(argv[i], "-j") == 0) {
+			job_benchmark(i + 1 < argc ? atol(argv[i + 1]) : 1000, pin);
+			return 0;
+		} else if (strcmp(argv[i], "-w") == 0) {
+			walk_benchmark(i + 1 < argc ? atol(argv[i + 1]) : 1000000);
+			return 0;
+		} else if (strcmp(argv[i], "-s") == 0) {
+			search_benchmark(i + 1 < argc ? atol(argv[i + 1]) : 1024);
+			return 0;
+		} else {
+			break;
+		}
+	}
+
+	if (argc - i < (patterns != NULL ? 1 : 2) || mode < 0 || format < 0) {
+		fprintf(stderr, "%s [-d dir_workers] [-f file_workers] [-p] [-i auto|stdio|pread|mmap] [-o text|nul|json] path string\n"
+				"%s [-d dir_workers] [-f file_workers] [-p] [-i auto|stdio|pread|mmap] [-o text|nul|json] -P pattern_file path\n"
+				"%s [-p] -b [files]\n"
+				"%s [-p] -j [searches]\n"
+				"%s [-p] -r [files]\n"
+				"%s -w [files]\n"
+				"%s -s [megabytes]\n"
+				"%s -a [megabytes]\n"
+				"%s [-p] -m [megabytes]\n"
+				"%s [-p] -c [megabytes]\n", argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+		return -1;
+	}
+
+	status = create_crew(&crew, dirs, files, pin);
+	if (status != 0) {
+		err_abort(status, "Create crew");
+	}
+	crew.io_mode = mode;
+	if (patterns != NULL) {
+		status = load_patterns(&ac, patterns);
+		if (status != 0) {
+			err_abort(status, "Load patterns");
+		}
+	}
+
+	status = crew_start(&crew, &job, argv[i], patterns != NULL ? "" : argv[i + 1],
+			patterns != NULL ? &ac : NULL, stdout, format);
+	if (status != 0) {
+		err_abort(status, "Crew start");
+	}
+	status = crew_wait(&crew, &job);
+	if (status != 0) {
+		err_abort(status, "Crew wait");
+	}
+	// only the output of the search in the machine readable formats
+	if (format == FORMAT_TEXT) {
+		pool_stats(&crew.work_pool);
 	}
+	crew_destroy(&crew);
 
 	return 0;
 }
@@ -1,21 +1,136 @@
+// syscall() for futex
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
+#include <malloc.h>
 #include "errors.h"
+#include "pool.h"
+
+/* default capacity of the ring buffer in front of each stage */
+#define	PIPE_DEPTH	16
+
+/* transport between stages, chosen at create_pipe */
+#define	PIPE_LOCKED	0		/* ring under stage mutex, wait on conds */
+#define	PIPE_SPSC	1		/* lock-free single producer single consumer ring */
+
+#define	CACHE_LINE	64
+/* polls of the other side's index before parking on its futex */
+#define	PIPE_SPIN	200
+
+/*
+ * What a stage thread does with the items passing through it. Items are
+ * opaque pointers handed from stage to stage without copying, so a stage
+ * owns an item between receiving and passing it on. NULL hooks are skipped.
+ */
+typedef struct stage_def_tag {
+	// called in stage thread before the first item, return context of the other hooks
+	void				*(*init)(void *arg);
+	// process item in place or replace it, return 0 to drop it
+	int				(*process)(void *context, void **item);
+	// called in stage thread at end of stream, return 1 to pass item on as last item,
+	// also when the pipe is aborted, and then the item is released
+	int				(*teardown)(void *context, void **item);
+	// argument of init, or context when there is no init
+	void				*arg;
+	// threads running the stage, each with its own context, 0 for 1
+	int				replicas;
+	// replicas pass items on in the order the stage received them
+	int				ordered;
+	// free an item the stage receives, for items pipe_abort discards, NULL to leak them
+	void				(*release)(void *item);
+} stage_def_t;
+
+/* end of stream marker sent by pipe_close, stage threads exit after passing it on */
+static char pipe_end_marker;
+#define	PIPE_END	((void *)&pipe_end_marker)
+
+/* service time histogram, bucket n counts items served in less than 2^n ns */
+#define	SERVICE_BUCKETS	32
+
+/*
+ * counters of one stage thread, only written by that thread with relaxed
+ * stores, so pipe_dump can read them live without stopping it, and on
+ * their own cache line so replicas don't share one
+ */
+typedef struct stage_stats_tag {
+	long				items;
+	long				batches;
+	long long			wait_avail;	/* ns receiving, blocked on avail when empty */
+	long long			wait_ready;	/* ns sending, blocked on next stage's ready when full */
+	long long			service;	/* ns processing */
+	long				histogram[SERVICE_BUCKETS];
+	// what the thread is doing since when, so pipe_dump sees a wait in progress
+	int				state;
+	long long			since;
+} __attribute__((aligned(CACHE_LINE))) stage_stats_t;
+
+/* stage_stats_t state */
+#define	STAGE_INPUT	0		/* receiving */
+#define	STAGE_BUSY	1		/* processing */
+#define	STAGE_OUTPUT	2		/* sending */
+
+#define	STAT_ADD(counter, value)	__atomic_store_n(&(counter), (counter) + (value), __ATOMIC_RELAXED)
+
+/* index of a PIPE_SPSC ring, written by one side only */
+typedef struct spsc_index_tag {
+	// free running, slot is index & (capacity - 1)
+	unsigned int			index;
+	// the other side is parked on the futex of epoch, waiting for index to move
+	int				waiting;
+	// bumped to wake the other side, when index moved or the pipe is aborted
+	unsigned int			epoch;
+} __attribute__((aligned(CACHE_LINE))) spsc_index_t;
 
 typedef struct stage_tag {
 	struct stage_tag		*link;
 	// protect access to stage_tag
 	pthread_mutex_t			mutex;
-	// the stage is ready to process new data
+	// the stage has room for new data
 	pthread_cond_t			ready;
 	// the stage has data to process by stage thread
 	pthread_cond_t			avail;
-	// predicate for cond ready: has_data == 0
-	// predicate for cond avail: has_data == 1
-	int				has_data;
-	// stage thread to process data
-	pthread_t			thread;
-	// this is our data
-	long				data;
+	// predicate for cond ready: count < capacity
+	// predicate for cond avail: count > 0
+	// ring buffer of data waiting for the stage thread, oldest at first
+	void				**buffer;
+	int				capacity;
+	int				first;
+	int				count;
+	int				transport;
+	// PIPE_SPSC ring uses head and tail instead of mutex, conds, first and count,
+	// capacity is a power of 2, and head and tail are on their own cache lines
+	spsc_index_t			head;		/* next slot to read, written by receiver */
+	spsc_index_t			tail;		/* next slot to write, written by sender */
+	// stage threads to process data, and what they do, unused by tail
+	pthread_t			*threads;
+	stage_def_t			def;
+	// replicated stage, threads take batches by ticket in arrival order, and complete
+	// them in ticket order when ordered, or when passing on PIPE_END,
+	// next_ticket is protected by mutex, completed and live by order_mutex
+	unsigned long			next_ticket;
+	pthread_mutex_t			order_mutex;
+	// predicate completed == ticket of a waiting replica
+	pthread_cond_t			order;
+	unsigned long			completed;
+	// replicas not yet past PIPE_END
+	int				live;
+	// eventfd counting items sent into an empty ring, -1 when unused, set for tail by pipe_event_fd
+	int				event_fd;
+	// one per replica, indexed in thread start order
+	stage_stats_t			*stats;
+	int				started;
+	// set by pipe_abort, waits give up and stage threads exit, always read atomically,
+	// with acquire so release below is seen with it
+	int				aborted;
+	// def.release, or for the tail what pipe_abort got for results, stored before aborted
+	void				(*release)(void *item);
 } stage_t;
 
 
@@ -29,95 +144,698 @@ typedef struct pipe_tag {
 	stage_t				*tail;
 	// number of stages in the pipeline
 	int				stages;
+	// capacity of each stage's ring buffer
+	int				depth;
+	// PIPE_LOCKED or PIPE_SPSC
+	int				transport;
 	// number of data items
 	int				activity;
+	// pipe_close sent PIPE_END
+	int				closed;
+	// pipe_next got PIPE_END
+	int				ended;
+	// CLOCK_MONOTONIC ns at create_pipe, for utilization
+	long long			created;
 } pipe_t;
 
 
-int pipe_send(stage_t *stage, int data)
+/*
+ * wait until the other side moves index away from value, spin a little,
+ * then park on the futex until CLOCK_REALTIME abstime, or forever when
+ * abstime is NULL, return the new index, or value when time is up or
+ * stage is aborted
+ */
+unsigned int spsc_wait(stage_t *stage, spsc_index_t *other, unsigned int value,
+		const struct timespec *abstime)
 {
-	int status;
+	int i;
+	unsigned int index, epoch;
+
+	for (i = 0; i < PIPE_SPIN; ++i) {
+		index = __atomic_load_n(&other->index, __ATOMIC_ACQUIRE);
+		if (index != value) {
+			return index;
+		}
+	}
+
+	while (1) {
+		// announce before the last check, the other side checks waiting after moving index,
+		// and a wake up after reading epoch makes the futex wait return at once
+		epoch = __atomic_load_n(&other->epoch, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&other->waiting, 1, __ATOMIC_SEQ_CST);
+		index = __atomic_load_n(&other->index, __ATOMIC_SEQ_CST);
+		if (index != value || __atomic_load_n(&stage->aborted, __ATOMIC_SEQ_CST)) {
+			__atomic_store_n(&other->waiting, 0, __ATOMIC_RELAXED);
+			return index;
+		}
+		// the bitset wait takes an absolute time
+		if (syscall(SYS_futex, &other->epoch, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+					epoch, abstime, NULL, FUTEX_BITSET_MATCH_ANY) != 0) {
+			if (errno == ETIMEDOUT) {
+				__atomic_store_n(&other->waiting, 0, __ATOMIC_RELAXED);
+				return value;
+			}
+			if (errno != EAGAIN && errno != EINTR) {
+				errno_abort("Wait on stage futex");
+			}
+		}
+	}
+}
+
+/* wake whoever is parked waiting on side */
+void spsc_wake(spsc_index_t *side)
+{
+	__atomic_fetch_add(&side->epoch, 1, __ATOMIC_SEQ_CST);
+	if (syscall(SYS_futex, &side->epoch, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0) == -1) {
+		errno_abort("Wake stage futex");
+	}
+}
+
+/* publish a new index of our side and wake the other side if it's parked */
+void spsc_publish(spsc_index_t *mine, unsigned int index)
+{
+	__atomic_store_n(&mine->index, index, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&mine->waiting, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&mine->waiting, 0, __ATOMIC_RELAXED);
+		spsc_wake(mine);
+	}
+}
+
+/* add count to event_fd counter of a stage, if any, so epoll sees the stage readable */
+void pipe_notify(stage_t *stage, int count)
+{
+	uint64_t value = count;
+	int fd = __atomic_load_n(&stage->event_fd, __ATOMIC_ACQUIRE);
+
+	// a full counter means unread events anyway
+	if (fd >= 0 && write(fd, &value, sizeof(value)) != sizeof(value) && errno != EAGAIN) {
+		errno_abort("Write stage event fd");
+	}
+}
+
+/* PIPE_SPSC pipe_send_some, caller MUST be the only sender of stage */
+int spsc_send_some(stage_t *stage, void **data, int count)
+{
+	unsigned int tail = stage->tail.index, start;
+	unsigned int head = __atomic_load_n(&stage->head.index, __ATOMIC_ACQUIRE);
+	unsigned int mask = stage->capacity - 1;
+	int sent = 0;
+
+	while (count > 0) {
+		// ring is full
+		while (tail - head == stage->capacity || __atomic_load_n(&stage->aborted, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&stage->aborted, __ATOMIC_ACQUIRE)) {
+				return sent;
+			}
+			head = spsc_wait(stage, &stage->head, head, NULL);
+		}
+		start = tail;
+		while (count > 0 && tail - head < stage->capacity) {
+			stage->buffer[tail++ & mask] = *data++;
+			--count;
+			++sent;
+		}
+		spsc_publish(&stage->tail, tail);
+		// receiver had emptied the ring, checked after publishing like spsc_wait
+		head = __atomic_load_n(&stage->head.index, __ATOMIC_SEQ_CST);
+		if (head == start) {
+			pipe_notify(stage, tail - start);
+		}
+	}
+	return sent;
+}
+
+/* PIPE_SPSC pipe_receive_timed, caller MUST be the only receiver of stage */
+int spsc_receive_batch(stage_t *stage, void **data, int max, const struct timespec *abstime)
+{
+	int count = 0;
+	unsigned int head = stage->head.index;
+	unsigned int tail = __atomic_load_n(&stage->tail.index, __ATOMIC_ACQUIRE);
+	unsigned int mask = stage->capacity - 1;
+
+	// ring is empty
+	while (tail == head || __atomic_load_n(&stage->aborted, __ATOMIC_ACQUIRE)) {
+		if (__atomic_load_n(&stage->aborted, __ATOMIC_ACQUIRE)) {
+			return -ECANCELED;
+		}
+		tail = spsc_wait(stage, &stage->tail, tail, abstime);
+		if (tail == head && abstime != NULL) {
+			return 0;
+		}
+	}
+	while (count < max && head != tail) {
+		data[count++] = stage->buffer[head++ & mask];
+	}
+	spsc_publish(&stage->head, head);
+	return count;
+}
+
+/*
+ * push count items into stage's ring buffer, waiting on ready whenever it's
+ * full, so a batch larger than the ring goes in as room is made, return
+ * number of items pushed, less than count when the stage is aborted,
+ * or -status
+ */
+int pipe_send_some(stage_t *stage, void **data, int count)
+{
+	int status, was_empty, notify = 0, sent = 0;
+
+	if (stage->transport == PIPE_SPSC) {
+		return spsc_send_some(stage, data, count);
+	}
 
 	status = pthread_mutex_lock(&stage->mutex);
 	if (status != 0) {
-		return status;
+		return -status;
+	}
+
+	while (count > 0) {
+		// wait on ready when the ring is full
+		while (stage->count == stage->capacity && !__atomic_load_n(&stage->aborted, __ATOMIC_ACQUIRE)) {
+			status = pthread_cond_wait(&stage->ready, &stage->mutex);
+			if (status != 0) {
+				pthread_mutex_unlock(&stage->mutex);
+				return -status;
+			}
+		}
+		if (__atomic_load_n(&stage->aborted, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		was_empty = stage->count == 0;
+		while (count > 0 && stage->count < stage->capacity) {
+			stage->buffer[(stage->first + stage->count) % stage->capacity] = *data++;
+			++stage->count;
+			--count;
+			++sent;
+		}
+
+		// stage threads only wait on avail while the ring is empty,
+		// there are several of them for a replicated stage
+		if (was_empty) {
+			notify += stage->count;
+			status = pthread_cond_broadcast(&stage->avail);
+			if (status != 0) {
+				pthread_mutex_unlock(&stage->mutex);
+				return -status;
+			}
+		}
+	}
+
+	status = pthread_mutex_unlock(&stage->mutex);
+	if (status != 0) {
+		return -status;
+	}
+	// receivers polling event_fd drain the ring until empty, so only an empty ring needs an event
+	if (notify > 0) {
+		pipe_notify(stage, notify);
+	}
+	return sent;
+}
+
+/* pipe_send_some, return 0, ECANCELED when the stage is aborted, or status */
+int pipe_send_batch(stage_t *stage, void **data, int count)
+{
+	int sent = pipe_send_some(stage, data, count);
+
+	if (sent < 0) {
+		return -sent;
+	}
+	return sent < count ? ECANCELED : 0;
+}
+
+/* free count items stage would receive, with its release hook */
+void pipe_release(stage_t *stage, void **data, int count)
+{
+	int i;
+	void (*release)(void *item) = __atomic_load_n(&stage->release, __ATOMIC_ACQUIRE);
+
+	if (release == NULL) {
+		return;
+	}
+	for (i = 0; i < count; ++i) {
+		if (data[i] != PIPE_END) {
+			release(data[i]);
+		}
+	}
+}
+
+/*
+ * pass items of a stage thread on to stage, release those it no longer
+ * takes, return 0, or ECANCELED when stage is aborted
+ */
+int pipe_pass(stage_t *stage, void **data, int count)
+{
+	int sent = pipe_send_some(stage, data, count);
+
+	if (sent < 0) {
+		err_abort(-sent, "Send data to stage");
+	}
+	if (sent < count) {
+		pipe_release(stage, data + sent, count - sent);
+		return ECANCELED;
+	}
+	return 0;
+}
+
+int pipe_send(stage_t *stage, void *data)
+{
+	return pipe_send_batch(stage, &data, 1);
+}
+
+/*
+ * push data into stage's ring buffer if it has room, without waiting,
+ * return 0, EAGAIN when it's full, or ECANCELED when the stage is aborted,
+ * caller MUST be the only sender of a PIPE_SPSC stage
+ */
+int pipe_try_send(stage_t *stage, void *data)
+{
+	int status, was_empty, aborted;
+	unsigned int tail, head;
+
+	if (stage->transport == PIPE_SPSC) {
+		if (__atomic_load_n(&stage->aborted, __ATOMIC_ACQUIRE)) {
+			return ECANCELED;
+		}
+		tail = stage->tail.index;
+		head = __atomic_load_n(&stage->head.index, __ATOMIC_ACQUIRE);
+		if (tail - head == stage->capacity) {
+			return EAGAIN;
+		}
+		stage->buffer[tail & (stage->capacity - 1)] = data;
+		spsc_publish(&stage->tail, tail + 1);
+		// receiver had emptied the ring, like spsc_send_some
+		if (__atomic_load_n(&stage->head.index, __ATOMIC_SEQ_CST) == tail) {
+			pipe_notify(stage, 1);
+		}
+		return 0;
 	}
 
-	// wait on ready when there is data for stage thread to process
-	while (stage->has_data) {
-		status = pthread_cond_wait(&stage->ready, &stage->mutex);
+	status = pthread_mutex_lock(&stage->mutex);
+	if (status != 0) {
+		return status;
+	}
+	aborted = __atomic_load_n(&stage->aborted, __ATOMIC_ACQUIRE);
+	if (aborted || stage->count == stage->capacity) {
+		status = aborted ? ECANCELED : EAGAIN;
+		pthread_mutex_unlock(&stage->mutex);
+		return status;
+	}
+	was_empty = stage->count == 0;
+	stage->buffer[(stage->first + stage->count) % stage->capacity] = data;
+	++stage->count;
+	if (was_empty) {
+		status = pthread_cond_broadcast(&stage->avail);
 		if (status != 0) {
 			pthread_mutex_unlock(&stage->mutex);
 			return status;
 		}
 	}
+	status = pthread_mutex_unlock(&stage->mutex);
+	if (status != 0) {
+		return status;
+	}
+	if (was_empty) {
+		pipe_notify(stage, 1);
+	}
+	return 0;
+}
 
-	stage->data = data;
+/*
+ * PIPE_LOCKED pipe_receive_timed, with the ticket of the batch when ticket
+ * is not NULL, for a replicated stage
+ */
+int pipe_receive_ticket(stage_t *stage, void **data, int max, unsigned long *ticket,
+		const struct timespec *abstime)
+{
+	int status, was_full, count = 0;
 
-	// change predicate for avial
-	stage->has_data = 1;
-	// signal stage thread to process stage data
-	status = pthread_cond_signal(&stage->avail);
+	status = pthread_mutex_lock(&stage->mutex);
 	if (status != 0) {
-		pthread_mutex_unlock(&stage->mutex);
-		return status;
+		return -status;
+	}
+
+	// wait on avail when there is no data for stage thread to process
+	while (stage->count == 0 || __atomic_load_n(&stage->aborted, __ATOMIC_ACQUIRE)) {
+		if (__atomic_load_n(&stage->aborted, __ATOMIC_ACQUIRE)) {
+			pthread_mutex_unlock(&stage->mutex);
+			return -ECANCELED;
+		}
+		if (abstime != NULL) {
+			status = pthread_cond_timedwait(&stage->avail, &stage->mutex, abstime);
+		} else {
+			status = pthread_cond_wait(&stage->avail, &stage->mutex);
+		}
+		if (status == ETIMEDOUT) {
+			pthread_mutex_unlock(&stage->mutex);
+			return 0;
+		}
+		if (status != 0) {
+			pthread_mutex_unlock(&stage->mutex);
+			return -status;
+		}
+	}
+
+	was_full = stage->count == stage->capacity;
+	while (count < max && stage->count > 0) {
+		data[count++] = stage->buffer[stage->first];
+		stage->first = (stage->first + 1) % stage->capacity;
+		--stage->count;
+	}
+	if (ticket != NULL) {
+		*ticket = stage->next_ticket++;
+	}
+
+	// senders only wait on ready while the ring is full,
+	// there are several of them after a replicated stage
+	if (was_full) {
+		status = pthread_cond_broadcast(&stage->ready);
+		if (status != 0) {
+			pthread_mutex_unlock(&stage->mutex);
+			return -status;
+		}
 	}
 
 	status = pthread_mutex_unlock(&stage->mutex);
-	return status;
+	if (status != 0) {
+		return -status;
+	}
+	return count;
+}
+
+/*
+ * pop up to max items from stage's ring buffer into data, waiting while
+ * it's empty until CLOCK_REALTIME abstime, or forever when abstime is NULL,
+ * return number of items, 0 when time is up, -ECANCELED when the stage is
+ * aborted, or -status
+ */
+int pipe_receive_timed(stage_t *stage, void **data, int max, const struct timespec *abstime)
+{
+	if (stage->transport == PIPE_SPSC) {
+		return spsc_receive_batch(stage, data, max, abstime);
+	}
+	return pipe_receive_ticket(stage, data, max, NULL, abstime);
+}
+
+int pipe_receive_batch(stage_t *stage, void **data, int max)
+{
+	return pipe_receive_timed(stage, data, max, NULL);
+}
+
+long long now_nsec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* stats of the calling stage thread, which starts waiting for input */
+stage_stats_t *stage_stats(stage_t *stage)
+{
+	stage_stats_t *stats = &stage->stats[__atomic_fetch_add(&stage->started, 1, __ATOMIC_RELAXED)];
+
+	stats->state = STAGE_INPUT;
+	__atomic_store_n(&stats->since, now_nsec(), __ATOMIC_RELAXED);
+	return stats;
+}
+
+/* add the time since the last mark to what the thread was doing, then enter state */
+void stage_mark(stage_stats_t *stats, int state, long long now)
+{
+	long long elapsed = now - stats->since;
+
+	switch (stats->state) {
+		case STAGE_INPUT:
+			STAT_ADD(stats->wait_avail, elapsed);
+			break;
+		case STAGE_BUSY:
+			STAT_ADD(stats->service, elapsed);
+			break;
+		default:
+			STAT_ADD(stats->wait_ready, elapsed);
+			break;
+	}
+	__atomic_store_n(&stats->state, state, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->since, now, __ATOMIC_RELAXED);
+}
+
+/* account a batch of count items processed in service ns */
+void stage_served(stage_stats_t *stats, int count, long long service)
+{
+	int bucket;
+	long long per_item = service / (count > 0 ? count : 1);
+
+	STAT_ADD(stats->items, count);
+	STAT_ADD(stats->batches, 1);
+	for (bucket = 0; bucket < SERVICE_BUCKETS - 1 && per_item >= 1LL << bucket; ++bucket) {
+		;
+	}
+	STAT_ADD(stats->histogram[bucket], count);
+}
+
+/* tear down context of a stage thread quitting on pipe_abort */
+void stage_abort(stage_t *stage, void *context)
+{
+	void *item = PIPE_END;
+
+	if (stage->def.teardown != NULL && stage->def.teardown(context, &item)) {
+		pipe_release(stage->link, &item, 1);
+	}
 }
 
 void *stage_thread(void *arg)
+{
+	int i, count, out, end = 0;
+	stage_t *stage = (stage_t *)arg;
+	stage_t *next_stage = stage->link;
+	void **batch, *item, *context = stage->def.arg;
+	stage_stats_t *stats = stage_stats(stage);
+	long long received, processed;
+
+	// plus 1 for an item from teardown before PIPE_END
+	batch = malloc((stage->capacity + 1) * sizeof(void *));
+	if (batch == NULL) {
+		errno_abort("Allocate memory for stage batch");
+	}
+
+	if (stage->def.init != NULL) {
+		context = stage->def.init(stage->def.arg);
+	}
+
+	while (!end) {
+		// take everything queued in one critical section, so the sender can run ahead
+		count = pipe_receive_batch(stage, batch, stage->capacity);
+		if (count == -ECANCELED) {
+			break;
+		}
+		if (count < 0) {
+			err_abort(-count, "Receive data in stage thread");
+		}
+		received = now_nsec();
+		stage_mark(stats, STAGE_BUSY, received);
+
+		// process items in place in batch, keep those passed on at the front
+		for (i = out = 0; i < count; ++i) {
+			item = batch[i];
+			if (item == PIPE_END) {
+				if (stage->def.teardown != NULL && stage->def.teardown(context, &item)) {
+					batch[out++] = item;
+				}
+				batch[out++] = PIPE_END;
+				end = 1;
+				break;
+			}
+			if (stage->def.process(context, &item)) {
+				batch[out++] = item;
+			}
+		}
+		processed = now_nsec();
+		stage_served(stats, i, processed - received);
+		stage_mark(stats, STAGE_OUTPUT, processed);
+		if (out > 0) {
+			pipe_pass(next_stage, batch, out);
+		}
+		stage_mark(stats, STAGE_INPUT, now_nsec());
+	}
+
+	// aborted, let teardown free the context
+	if (!end) {
+		stage_abort(stage, context);
+	}
+	free(batch);
+	return NULL;
+}
+
+/* wait until completed reaches ticket or stage is aborted, caller MUST have order_mutex locked */
+void wait_turn(stage_t *stage, unsigned long ticket)
 {
 	int status;
+
+	while (stage->completed != ticket && !__atomic_load_n(&stage->aborted, __ATOMIC_ACQUIRE)) {
+		status = pthread_cond_wait(&stage->order, &stage->order_mutex);
+		if (status != 0) {
+			err_abort(status, "Wait on stage order cond");
+		}
+	}
+}
+
+/*
+ * thread of a replicated stage, like stage_thread, but takes at most its
+ * share of the ring so the other replicas get work, and counts its batch
+ * completed after passing it on, in ticket order when the stage is ordered.
+ * The replica getting PIPE_END hands it on to the next replica, and the
+ * last one passes it on after all batches before it.
+ */
+void *replica_thread(void *arg)
+{
+	int status, i, count, out, max, last, end = 0;
+	unsigned long ticket;
 	stage_t *stage = (stage_t *)arg;
 	stage_t *next_stage = stage->link;
+	void **batch, *item, *context = stage->def.arg;
+	stage_stats_t *stats = stage_stats(stage);
+	long long received, processed;
 
-	status = pthread_mutex_lock(&stage->mutex);
-	if (status != 0) {
-		err_abort(status, "Lock mutex in stage thread");
+	max = stage->capacity / stage->def.replicas;
+	if (max < 1) {
+		max = 1;
+	}
+	// plus 1 for an item from teardown before PIPE_END
+	batch = malloc((max + 1) * sizeof(void *));
+	if (batch == NULL) {
+		errno_abort("Allocate memory for stage batch");
 	}
 
-	printf("Enter a number as input or '=' character to get result\n");
-	while (1) {
-		// wait on avail when there is no data for stage thread to process
-		while (!stage->has_data) {
-			status = pthread_cond_wait(&stage->avail, &stage->mutex);
+	if (stage->def.init != NULL) {
+		context = stage->def.init(stage->def.arg);
+	}
+
+	while (!end) {
+		count = pipe_receive_ticket(stage, batch, max, &ticket, NULL);
+		if (count == -ECANCELED) {
+			break;
+		}
+		if (count < 0) {
+			err_abort(-count, "Receive data in stage thread");
+		}
+		received = now_nsec();
+		stage_mark(stats, STAGE_BUSY, received);
+
+		for (i = out = 0; i < count; ++i) {
+			item = batch[i];
+			if (item == PIPE_END) {
+				end = 1;
+				break;
+			}
+			if (stage->def.process(context, &item)) {
+				batch[out++] = item;
+			}
+		}
+		processed = now_nsec();
+		stage_served(stats, i, processed - received);
+		stage_mark(stats, STAGE_OUTPUT, processed);
+
+		// waiting for the turn counts as blocked on output
+		if (stage->def.ordered || end) {
+			status = pthread_mutex_lock(&stage->order_mutex);
+			if (status != 0) {
+				err_abort(status, "Lock stage order mutex");
+			}
+			wait_turn(stage, ticket);
+			status = pthread_mutex_unlock(&stage->order_mutex);
 			if (status != 0) {
-				err_abort(status, "Wait on cond avail in stage thread");
+				err_abort(status, "Unlock stage order mutex");
 			}
 		}
+		if (out > 0) {
+			pipe_pass(next_stage, batch, out);
+		}
 
-		// process data, plus 1, then pass it to next stage
-		pipe_send(next_stage, stage->data + 1);
+		if (end) {
+			out = 0;
+			if (stage->def.teardown != NULL && stage->def.teardown(context, &item)) {
+				batch[out++] = item;
+			}
+			status = pthread_mutex_lock(&stage->order_mutex);
+			if (status != 0) {
+				err_abort(status, "Lock stage order mutex");
+			}
+			last = --stage->live == 0;
+			status = pthread_mutex_unlock(&stage->order_mutex);
+			if (status != 0) {
+				err_abort(status, "Unlock stage order mutex");
+			}
+			if (last) {
+				batch[out++] = PIPE_END;
+			}
+			if (out > 0) {
+				pipe_pass(next_stage, batch, out);
+			}
+			if (!last) {
+				pipe_send(stage, PIPE_END);
+			}
+		}
 
-		// change predicate for ready
-		stage->has_data = 0;
-		// signal stage it can accept new data
-		status = pthread_cond_signal(&stage->ready);
+		status = pthread_mutex_lock(&stage->order_mutex);
+		if (status != 0) {
+			err_abort(status, "Lock stage order mutex");
+		}
+		++stage->completed;
+		status = pthread_cond_broadcast(&stage->order);
+		if (status != 0) {
+			err_abort(status, "Broadcast stage order cond");
+		}
+		status = pthread_mutex_unlock(&stage->order_mutex);
 		if (status != 0) {
-			err_abort(status, "Signal stage to accept new data");
+			err_abort(status, "Unlock stage order mutex");
 		}
+		stage_mark(stats, STAGE_INPUT, now_nsec());
+	}
+
+	if (!end) {
+		stage_abort(stage, context);
 	}
+	free(batch);
+	return NULL;
 }
 
-int create_pipe(pipe_t *pipe, int stages)
+/*
+ * create a pipeline of stages, the first stages - 1 run defs[i].replicas
+ * threads doing defs[i], the last only holds results
+ */
+int create_pipe(pipe_t *pipe, int stages, stage_def_t *defs, int depth, int transport)
 {
-	int status;
+	int status, i, replicas;
 	stage_t **link = &pipe->head, *next_stage, *stage;
 
 	pipe->stages = stages;
+	pipe->closed = 0;
+	pipe->ended = 0;
+	pipe->created = now_nsec();
+	pipe->depth = depth;
+	pipe->transport = transport;
 	pipe->activity = 0;
 
+	// head and tail indices of PIPE_SPSC wrap, so round capacity up to a power of 2
+	if (transport == PIPE_SPSC && (depth & (depth - 1)) != 0) {
+		while (depth & (depth - 1)) {
+			depth &= depth - 1;
+		}
+		depth *= 2;
+		pipe->depth = depth;
+	}
+
 	status = pthread_mutex_init(&pipe->mutex, NULL);
 	if (status != 0) {
 		err_abort(status, "Init pipe mutex");
 	}
 
-	for (int i = 0; i < stages; ++i) {
-		next_stage = malloc(sizeof(stage_t));
-		if (next_stage == NULL) {
-			errno_abort("Allocate memory for stage");
+	for (i = 0; i < stages; ++i) {
+		// align for cache line aligned head and tail
+		status = posix_memalign((void **)&next_stage, CACHE_LINE, sizeof(stage_t));
+		if (status != 0) {
+			err_abort(status, "Allocate memory for stage");
 		}
 
 		status = pthread_mutex_init(&next_stage->mutex, NULL);
@@ -134,8 +852,55 @@ int create_pipe(pipe_t *pipe, int stages)
 		if (status != 0) {
 			err_abort(status, "Init stage's avail cond");
 		}
-		next_stage->has_data = 0;
-		next_stage->data = 0;
+		next_stage->buffer = malloc(depth * sizeof(void *));
+		if (next_stage->buffer == NULL) {
+			errno_abort("Allocate memory for stage buffer");
+		}
+		next_stage->capacity = depth;
+		next_stage->first = 0;
+		next_stage->count = 0;
+		// replicas share their input ring, and all send into the next one
+		next_stage->transport = transport;
+		if ((i < stages - 1 && defs[i].replicas > 1) || (i > 0 && defs[i - 1].replicas > 1)) {
+			next_stage->transport = PIPE_LOCKED;
+		}
+		next_stage->head.index = next_stage->tail.index = 0;
+		next_stage->head.waiting = next_stage->tail.waiting = 0;
+		next_stage->head.epoch = next_stage->tail.epoch = 0;
+		next_stage->aborted = 0;
+		if (i < stages - 1) {
+			next_stage->def = defs[i];
+		} else {
+			memset(&next_stage->def, 0, sizeof(stage_def_t));
+		}
+		next_stage->release = next_stage->def.release;
+		if (next_stage->def.replicas < 1) {
+			next_stage->def.replicas = 1;
+		}
+
+		status = pthread_mutex_init(&next_stage->order_mutex, NULL);
+		if (status != 0) {
+			err_abort(status, "Init stage order mutex");
+		}
+		status = pthread_cond_init(&next_stage->order, NULL);
+		if (status != 0) {
+			err_abort(status, "Init stage's order cond");
+		}
+		next_stage->next_ticket = 0;
+		next_stage->completed = 0;
+		next_stage->live = next_stage->def.replicas;
+		next_stage->event_fd = -1;
+		next_stage->started = 0;
+		status = posix_memalign((void **)&next_stage->stats, CACHE_LINE,
+				next_stage->def.replicas * sizeof(stage_stats_t));
+		if (status != 0) {
+			err_abort(status, "Allocate memory for stage stats");
+		}
+		memset(next_stage->stats, 0, next_stage->def.replicas * sizeof(stage_stats_t));
+		next_stage->threads = malloc(next_stage->def.replicas * sizeof(pthread_t));
+		if (next_stage->threads == NULL) {
+			errno_abort("Allocate memory for stage threads");
+		}
 
 		*link = next_stage;
 		link = &next_stage->link;
@@ -147,16 +912,20 @@ int create_pipe(pipe_t *pipe, int stages)
 
 	// init stage thread, final stage don't have stage thread, so stage thread don't need to check next_stage is NULL
 	for (stage = pipe->head; stage->link != NULL; stage = stage->link) {
-		status = pthread_create(&stage->thread, NULL, stage_thread, stage);
-		if (status != 0) {
-			err_abort(status, "Create stage thread");
+		replicas = stage->def.replicas;
+		for (i = 0; i < replicas; ++i) {
+			status = pthread_create(&stage->threads[i], NULL,
+					replicas > 1 ? replica_thread : stage_thread, stage);
+			if (status != 0) {
+				err_abort(status, "Create stage thread");
+			}
 		}
 	}
 
 	return 0;
 }
 
-int pipe_start(pipe_t *pipe, long data)
+int pipe_start(pipe_t *pipe, void *data)
 {
 	int status;
 	status = pthread_mutex_lock(&pipe->mutex);
@@ -176,71 +945,1190 @@ int pipe_start(pipe_t *pipe, long data)
 	return 0;
 }
 
-// return 0 when pipe is empty
-// return 1 otherwise
-int pipe_result(pipe_t *pipe, long *result)
+/*
+ * pipe_start without waiting for room in the first stage, return 0, or
+ * EAGAIN when it's full, for a thread that also takes the results, and
+ * would wait on itself
+ */
+int pipe_try_start(pipe_t *pipe, void *data)
 {
-	int status;
-	int empty = 0;
-	stage_t *stage;
+	int status, result;
 
+	// counted before it's sent like pipe_start, so a result is never ahead of its count
 	status = pthread_mutex_lock(&pipe->mutex);
 	if (status != 0) {
 		err_abort(status, "Lock pipe mutex");
 	}
-	if (pipe->activity <= 0) {
-		// Can't just return without unlock mutex you have
-		// return 0;
-		empty = 1;
-	} else {
+	++pipe->activity;
+	status = pthread_mutex_unlock(&pipe->mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock pipe mutex");
+	}
+
+	result = pipe_try_send(pipe->head, data);
+	if (result != 0) {
+		status = pthread_mutex_lock(&pipe->mutex);
+		if (status != 0) {
+			err_abort(status, "Lock pipe mutex");
+		}
 		--pipe->activity;
+		status = pthread_mutex_unlock(&pipe->mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock pipe mutex");
+		}
 	}
+	return result;
+}
+
+/* abstime in the past, to poll without waiting */
+const struct timespec pipe_nowait = {0, 0};
 
+/*
+ * receive up to max results, waiting until CLOCK_REALTIME abstime for the
+ * first, or forever when abstime is NULL, or not at all for &pipe_nowait,
+ * return number of results, 0 when pipe is empty or time is up,
+ * counts items started, so only for pipelines passing on every item,
+ * receivers may share a PIPE_LOCKED pipe, but of a PIPE_SPSC pipe the
+ * caller MUST be the only receiver, like pipe_next
+ */
+int pipe_results(pipe_t *pipe, void **results, int max, const struct timespec *abstime)
+{
+	int status, count;
+
+	// reserve up to max of the items started, so receivers of a PIPE_LOCKED tail don't wait on the same ones
+	status = pthread_mutex_lock(&pipe->mutex);
+	if (status != 0) {
+		err_abort(status, "Lock pipe mutex");
+	}
+	if (max > pipe->activity) {
+		max = pipe->activity;
+	}
+	if (max > 0) {
+		pipe->activity -= max;
+	}
 	status = pthread_mutex_unlock(&pipe->mutex);
 	if (status != 0) {
 		err_abort(status, "Unlock pipe mutex");
 	}
 
-	if (empty) {
+	if (max <= 0) {
 		return 0;
 	}
 
-	stage = pipe->tail;
-	status = pthread_mutex_lock(&stage->mutex);
+	count = pipe_receive_timed(pipe->tail, results, max, abstime);
+	if (count < 0) {
+		err_abort(-count, "Receive result");
+	}
+
+	// give back what was reserved but not received
+	if (count < max) {
+		status = pthread_mutex_lock(&pipe->mutex);
+		if (status != 0) {
+			err_abort(status, "Lock pipe mutex");
+		}
+		pipe->activity += max - count;
+		status = pthread_mutex_unlock(&pipe->mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock pipe mutex");
+		}
+	}
+	return count;
+}
+
+// return 0 when pipe is empty
+// return 1 otherwise
+int pipe_result(pipe_t *pipe, void **result)
+{
+	return pipe_results(pipe, result, 1, NULL);
+}
+
+// return 0 when pipe is empty or no result is ready yet
+// return 1 otherwise
+int pipe_result_try(pipe_t *pipe, void **result)
+{
+	return pipe_results(pipe, result, 1, &pipe_nowait);
+}
+
+// return 0 when pipe is empty or no result is ready by CLOCK_REALTIME abstime
+// return 1 otherwise
+int pipe_result_timed(pipe_t *pipe, void **result, const struct timespec *abstime)
+{
+	return pipe_results(pipe, result, 1, abstime);
+}
+
+/*
+ * return an eventfd that's readable while results may be waiting, for
+ * poll, select or epoll, created on first call. The counter is only bumped
+ * when a result arrives in an empty tail, so after it's readable, read it
+ * and take results with pipe_results and &pipe_nowait until none is left.
+ */
+int pipe_event_fd(pipe_t *pipe)
+{
+	int status, fd;
+
+	status = pthread_mutex_lock(&pipe->mutex);
 	if (status != 0) {
-		err_abort(status, "Lock tail stage mutex");
+		err_abort(status, "Lock pipe mutex");
+	}
+	fd = pipe->tail->event_fd;
+	if (fd < 0) {
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0) {
+			errno_abort("Create pipe event fd");
+		}
+		__atomic_store_n(&pipe->tail->event_fd, fd, __ATOMIC_RELEASE);
+		// results which came before any event to find them
+		pipe_notify(pipe->tail, 1);
 	}
+	status = pthread_mutex_unlock(&pipe->mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock pipe mutex");
+	}
+	return fd;
+}
+
+/* upper bound in ns of the bucket holding the fraction of items served */
+long long service_percentile(long *histogram, long items, double fraction)
+{
+	int bucket;
+	long seen = 0;
 
-	// wait for result
-	while (!stage->has_data) {
-		status = pthread_cond_wait(&stage->avail, &stage->mutex);
+	for (bucket = 0; bucket < SERVICE_BUCKETS - 1; ++bucket) {
+		seen += histogram[bucket];
+		if (seen >= items * fraction) {
+			break;
+		}
+	}
+	return 1LL << bucket;
+}
+
+/*
+ * print counters of each stage summed over its threads, and each thread's
+ * share of time since create_pipe spent processing, waiting for input and
+ * waiting for room downstream, the busiest stage is the bottleneck
+ */
+void pipe_dump(pipe_t *pipe)
+{
+	int i, bucket, index = 0;
+	stage_t *stage;
+	stage_stats_t total, *stats;
+	long long now = now_nsec(), since;
+	double elapsed = now - pipe->created, threads;
+	long queued;
+
+	for (stage = pipe->head; stage != NULL; stage = stage->link, ++index) {
+		if (stage->transport == PIPE_SPSC) {
+			queued = __atomic_load_n(&stage->tail.index, __ATOMIC_RELAXED)
+				- __atomic_load_n(&stage->head.index, __ATOMIC_RELAXED);
+		} else {
+			queued = __atomic_load_n(&stage->count, __ATOMIC_RELAXED);
+		}
+		if (stage->link == NULL) {
+			printf("tail: %ld queued of %d\n", queued, stage->capacity);
+			break;
+		}
+
+		memset(&total, 0, sizeof(total));
+		for (i = 0; i < stage->def.replicas; ++i) {
+			stats = &stage->stats[i];
+			total.items += __atomic_load_n(&stats->items, __ATOMIC_RELAXED);
+			total.batches += __atomic_load_n(&stats->batches, __ATOMIC_RELAXED);
+			total.wait_avail += __atomic_load_n(&stats->wait_avail, __ATOMIC_RELAXED);
+			total.wait_ready += __atomic_load_n(&stats->wait_ready, __ATOMIC_RELAXED);
+			total.service += __atomic_load_n(&stats->service, __ATOMIC_RELAXED);
+			// time in the current state isn't added yet, none before the thread started
+			since = __atomic_load_n(&stats->since, __ATOMIC_RELAXED);
+			if (since > 0) {
+				switch (__atomic_load_n(&stats->state, __ATOMIC_RELAXED)) {
+					case STAGE_INPUT:
+						total.wait_avail += now - since;
+						break;
+					case STAGE_BUSY:
+						total.service += now - since;
+						break;
+					default:
+						total.wait_ready += now - since;
+						break;
+				}
+			}
+			for (bucket = 0; bucket < SERVICE_BUCKETS; ++bucket) {
+				total.histogram[bucket] += __atomic_load_n(&stats->histogram[bucket], __ATOMIC_RELAXED);
+			}
+		}
+
+		threads = stage->def.replicas * elapsed / 100;
+		printf("stage %d, %d thread%s: %ld items in %ld batches, %ld queued of %d, "
+				"busy %.1f%%, waiting input %.1f%%, output %.1f%%, service p50 < %lld ns, p99 < %lld ns\n",
+				index, stage->def.replicas, stage->def.replicas > 1 ? "s" : "",
+				total.items, total.batches, queued, stage->capacity,
+				total.service / threads, total.wait_avail / threads, total.wait_ready / threads,
+				service_percentile(total.histogram, total.items, 0.5),
+				service_percentile(total.histogram, total.items, 0.99));
+	}
+}
+
+const char *transport_names[] = {"locked", "spsc"};
+
+/* end of stream, stage threads exit after passing on what they hold */
+int pipe_close(pipe_t *pipe)
+{
+	pipe->closed = 1;
+	return pipe_send(pipe->head, PIPE_END);
+}
+
+/*
+ * receive the next item out of the pipeline, return 0 at end of stream,
+ * caller MUST be the only receiver
+ */
+int pipe_next(pipe_t *pipe, void **item)
+{
+	int count;
+
+	if (pipe->ended) {
+		return 0;
+	}
+	count = pipe_receive_batch(pipe->tail, item, 1);
+	if (count < 0) {
+		err_abort(-count, "Receive result");
+	}
+	if (*item == PIPE_END) {
+		pipe->ended = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/* wait for all stage threads to exit */
+void pipe_join(pipe_t *pipe)
+{
+	int status, i;
+	stage_t *stage;
+
+	for (stage = pipe->head; stage->link != NULL; stage = stage->link) {
+		for (i = 0; i < stage->def.replicas; ++i) {
+			status = pthread_join(stage->threads[i], NULL);
+			if (status != 0) {
+				err_abort(status, "Join stage thread");
+			}
+		}
+	}
+}
+
+/* free what create_pipe allocated, caller MUST have joined the stage threads */
+void pipe_free(pipe_t *pipe)
+{
+	int status;
+	stage_t *stage, *next_stage;
+
+	for (stage = pipe->head; stage != NULL; stage = next_stage) {
+		next_stage = stage->link;
+		status = pthread_mutex_destroy(&stage->mutex);
+		if (status != 0) {
+			err_abort(status, "Destroy stage mutex");
+		}
+		status = pthread_cond_destroy(&stage->ready);
+		if (status != 0) {
+			err_abort(status, "Destroy stage's ready cond");
+		}
+		status = pthread_cond_destroy(&stage->avail);
+		if (status != 0) {
+			err_abort(status, "Destroy stage's avail cond");
+		}
+		status = pthread_mutex_destroy(&stage->order_mutex);
 		if (status != 0) {
-			err_abort(status, "Wait on tail avail cond");
+			err_abort(status, "Destroy stage order mutex");
 		}
+		status = pthread_cond_destroy(&stage->order);
+		if (status != 0) {
+			err_abort(status, "Destroy stage's order cond");
+		}
+		if (stage->event_fd >= 0) {
+			close(stage->event_fd);
+		}
+		free(stage->buffer);
+		free(stage->threads);
+		free(stage->stats);
+		free(stage);
 	}
+	pipe->head = pipe->tail = NULL;
 
-	*result = stage->data;
+	status = pthread_mutex_destroy(&pipe->mutex);
+	if (status != 0) {
+		err_abort(status, "Destroy pipe mutex");
+	}
+}
 
-	// change predicate for stage ready cond
-	stage->has_data = 0;
-	// signal stage ready cond
-	status = pthread_cond_signal(&stage->ready);
+/*
+ * graceful shutdown: close the pipe unless it's closed already, take the
+ * results still coming out, releasing them with release unless it's NULL,
+ * then join the stage threads and free the pipe. Caller MUST be the only
+ * user of the pipe.
+ */
+int pipe_drain(pipe_t *pipe, void (*release)(void *item))
+{
+	int status;
+	void *item;
 
-	status = pthread_mutex_unlock(&stage->mutex);
+	if (!pipe->closed) {
+		status = pipe_close(pipe);
+		if (status != 0) {
+			return status;
+		}
+	}
+	while (pipe_next(pipe, &item)) {
+		if (release != NULL) {
+			release(item);
+		}
+	}
+	pipe_join(pipe);
+	pipe_free(pipe);
+	return 0;
+}
+
+/*
+ * fast shutdown: stop the stage threads at their next wait, without
+ * processing what is queued, then join them and free the pipe. Threads
+ * call teardown to free their contexts, and every item in a ring or held
+ * by a thread is freed by the release hook of the stage it was going to,
+ * release for results. Caller MUST be the only user of the pipe.
+ */
+int pipe_abort(pipe_t *pipe, void (*release)(void *item))
+{
+	int status;
+	unsigned int index;
+	stage_t *stage;
+
+	// stage threads only release results once they see aborted
+	__atomic_store_n(&pipe->tail->release, release, __ATOMIC_RELEASE);
+	for (stage = pipe->head; stage != NULL; stage = stage->link) {
+		__atomic_store_n(&stage->aborted, 1, __ATOMIC_SEQ_CST);
+	}
+
+	// wake up every wait, waits check aborted with the mutex locked, or after reading epoch
+	for (stage = pipe->head; stage != NULL; stage = stage->link) {
+		status = pthread_mutex_lock(&stage->mutex);
+		if (status != 0) {
+			err_abort(status, "Lock stage mutex");
+		}
+		status = pthread_cond_broadcast(&stage->ready);
+		if (status != 0) {
+			err_abort(status, "Broadcast stage's ready cond");
+		}
+		status = pthread_cond_broadcast(&stage->avail);
+		if (status != 0) {
+			err_abort(status, "Broadcast stage's avail cond");
+		}
+		status = pthread_mutex_unlock(&stage->mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock stage mutex");
+		}
+
+		status = pthread_mutex_lock(&stage->order_mutex);
+		if (status != 0) {
+			err_abort(status, "Lock stage order mutex");
+		}
+		status = pthread_cond_broadcast(&stage->order);
+		if (status != 0) {
+			err_abort(status, "Broadcast stage order cond");
+		}
+		status = pthread_mutex_unlock(&stage->order_mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock stage order mutex");
+		}
+
+		spsc_wake(&stage->head);
+		spsc_wake(&stage->tail);
+	}
+	pipe_join(pipe);
+
+	// items left in the rings
+	for (stage = pipe->head; stage != NULL; stage = stage->link) {
+		if (stage->transport == PIPE_SPSC) {
+			for (index = stage->head.index; index != stage->tail.index; ++index) {
+				pipe_release(stage, &stage->buffer[index & (stage->capacity - 1)], 1);
+			}
+		} else {
+			for (; stage->count > 0; --stage->count) {
+				pipe_release(stage, &stage->buffer[stage->first], 1);
+				stage->first = (stage->first + 1) % stage->capacity;
+			}
+		}
+	}
+	pipe_free(pipe);
+	return 0;
+}
+
+/* stage of the interactive and benchmark pipelines, items are longs in the pointer */
+int add_one(void *context, void **item)
+{
+	*item = (void *)((intptr_t)*item + 1);
+	return 1;
+}
+
+/* pipeline of stages - 1 add_one threads */
+int create_add_pipe(pipe_t *pipe, int stages, int depth, int transport)
+{
+	int i, status;
+	stage_def_t *defs;
+
+	defs = calloc(stages, sizeof(stage_def_t));
+	if (defs == NULL) {
+		errno_abort("Allocate memory for stage defs");
+	}
+	for (i = 0; i < stages - 1; ++i) {
+		defs[i].process = add_one;
+	}
+	status = create_pipe(pipe, stages, defs, depth, transport);
+	free(defs);
+	return status;
+}
+
+/* items pushed through each benchmark pipeline */
+long bench_items;
+/* results out of order or with a wrong value */
+long bench_errors;
+
+/* drain bench_items results from the tail of a benchmark pipeline */
+void *drain_thread(void *arg)
+{
+	pipe_t *pipe = (pipe_t *)arg;
+	void **batch;
+	long received = 0;
+	int i, count;
+
+	batch = malloc(pipe->depth * sizeof(void *));
+	if (batch == NULL) {
+		errno_abort("Allocate memory for drain batch");
+	}
+
+	while (received < bench_items) {
+		count = pipe_receive_batch(pipe->tail, batch, pipe->depth);
+		if (count < 0) {
+			err_abort(-count, "Receive result");
+		}
+		// item n went in as n and was incremented once per stage thread
+		for (i = 0; i < count; ++i, ++received) {
+			if ((intptr_t)batch[i] != received + pipe->stages - 1) {
+				++bench_errors;
+			}
+		}
+	}
+	free(batch);
+	return NULL;
+}
+
+/*
+ * Push items through pipelines of 2 to 16 stages with ring depths of 1 to
+ * 256, in batches of the ring depth, and print items per second.
+ */
+void benchmark(long items, int transport)
+{
+	int status, stages, depth, i;
+	long sent;
+	void **batch;
+	pipe_t pipe;
+	pthread_t drain;
+	struct timespec start, end;
+	double seconds;
+
+	bench_items = items;
+	batch = malloc(256 * sizeof(void *));
+	if (batch == NULL) {
+		errno_abort("Allocate memory for benchmark batch");
+	}
+
+	for (stages = 2; stages <= 16; stages *= 2) {
+		for (depth = 1; depth <= 256; depth *= 4) {
+			create_add_pipe(&pipe, stages, depth, transport);
+			bench_errors = 0;
+			status = pthread_create(&drain, NULL, drain_thread, &pipe);
+			if (status != 0) {
+				err_abort(status, "Create drain thread");
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (sent = 0; sent < items; sent += depth) {
+				for (i = 0; i < depth && sent + i < items; ++i) {
+					batch[i] = (void *)(intptr_t)(sent + i);
+				}
+				status = pipe_send_batch(pipe.head, batch, i);
+				if (status != 0) {
+					err_abort(status, "Send benchmark batch");
+				}
+			}
+			status = pthread_join(drain, NULL);
+			if (status != 0) {
+				err_abort(status, "Join drain thread");
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+			pipe_drain(&pipe, NULL);
+
+			printf("%-6s %2d stages depth %3d: %10.0f items/s%s\n", transport_names[transport],
+					stages, depth, items / seconds, bench_errors == 0 ? "" : ", BAD RESULTS");
+		}
+	}
+	free(batch);
+}
+
+/*
+ * Send one item at a time and wait for it to come out of the tail before
+ * sending the next, so each round trip is the sum of the handoff latencies,
+ * and print nanoseconds per hop for pipelines of 2 to 16 stages.
+ */
+void latency_benchmark(long items, int transport)
+{
+	int stages, count;
+	long sent;
+	void *result;
+	pipe_t pipe;
+	struct timespec start, end;
+	double seconds;
+
+	for (stages = 2; stages <= 16; stages *= 2) {
+		create_add_pipe(&pipe, stages, PIPE_DEPTH, transport);
+		bench_errors = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (sent = 0; sent < items; ++sent) {
+			pipe_send(pipe.head, (void *)(intptr_t)sent);
+			count = pipe_receive_batch(pipe.tail, &result, 1);
+			if (count < 0) {
+				err_abort(-count, "Receive result");
+			}
+			if ((intptr_t)result != sent + stages - 1) {
+				++bench_errors;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		pipe_drain(&pipe, NULL);
+
+		// one hop into each stage, the tail included
+		printf("%-6s %2d stages: %8.0f ns/hop%s\n", transport_names[transport],
+				stages, seconds * 1e9 / items / stages, bench_errors == 0 ? "" : ", BAD RESULTS");
+	}
+}
+
+/* CPU time the slow stage of the replica benchmark spends on each item */
+#define	SLOW_NSEC	20000
+
+int slow_add_one(void *context, void **item)
+{
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	do {
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	} while ((now.tv_sec - start.tv_sec) * 1000000000L + now.tv_nsec - start.tv_nsec < SLOW_NSEC);
+	return add_one(context, item);
+}
+
+/*
+ * Push items through add_one, slow_add_one and add_one stages with the
+ * slow one replicated 1 to 8 times, ordered and unordered, and print
+ * items per second and the speedup over 1 replica. Results of an ordered
+ * stage must come out in order, those of an unordered one just all once.
+ */
+void replica_benchmark(long items, int transport)
+{
+	int status, replicas, ordered, count, i;
+	long sent, received, sum;
+	pipe_t pipe;
+	void **batch;
+	struct timespec start, end;
+	double seconds, base = 0;
+	stage_def_t defs[] = {
+		{NULL, add_one, NULL, NULL},
+		{NULL, slow_add_one, NULL, NULL},
+		{NULL, add_one, NULL, NULL},
+	};
+
+	batch = malloc(PIPE_DEPTH * sizeof(void *));
+	if (batch == NULL) {
+		errno_abort("Allocate memory for benchmark batch");
+	}
+
+	for (ordered = 1; ordered >= 0; --ordered) {
+		for (replicas = 1; replicas <= 8; replicas *= 2) {
+			defs[1].replicas = replicas;
+			defs[1].ordered = ordered;
+			create_pipe(&pipe, 4, defs, PIPE_DEPTH * replicas, transport);
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			bench_errors = 0;
+			received = sum = 0;
+			// send and receive from one thread, the rings hold PIPE_DEPTH per replica
+			for (sent = 0; sent < items || received < items; ) {
+				for (i = 0; i < PIPE_DEPTH && sent < items; ++i, ++sent) {
+					batch[i] = (void *)(intptr_t)sent;
+				}
+				if (i > 0) {
+					status = pipe_send_batch(pipe.head, batch, i);
+					if (status != 0) {
+						err_abort(status, "Send benchmark batch");
+					}
+				}
+				if (sent < items && sent - received < pipe.depth) {
+					continue;
+				}
+				count = pipe_receive_batch(pipe.tail, batch, PIPE_DEPTH);
+				if (count < 0) {
+					err_abort(-count, "Receive result");
+				}
+				for (i = 0; i < count; ++i, ++received) {
+					if (ordered && (intptr_t)batch[i] != received + 3) {
+						++bench_errors;
+					}
+					sum += (intptr_t)batch[i] - 3;
+				}
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+			if (replicas == 1) {
+				base = seconds;
+			}
+			if (sum != items * (items - 1) / 2) {
+				++bench_errors;
+			}
+			pipe_drain(&pipe, NULL);
+
+			printf("%-6s %-9s %d replicas: %8.0f items/s, speedup %.2f%s\n",
+					transport_names[transport], ordered ? "ordered" : "unordered", replicas,
+					items / seconds, base / seconds, bench_errors == 0 ? "" : ", BAD RESULTS");
+		}
+	}
+	free(batch);
+}
+
+/*
+ * File demo: the reader sends chunks of whole lines, parse counts lines
+ * and words, transform lowercases the text in place and aggregate counts
+ * letters, frees the chunks and at end of stream passes on a summary.
+ * Parse and transform may be replicated, chunks are independent.
+ * Chunks come from a pool, as aggregate frees what the reader allocates.
+ */
+#define	CHUNK_SIZE	(64 * 1024)
+
+typedef struct chunk_tag {
+	size_t				length;
+	long				lines;
+	long				words;
+	char				data[CHUNK_SIZE];
+} chunk_t;
+
+typedef struct summary_tag {
+	long				chunks;
+	long				bytes;
+	long				lines;
+	long				words;
+	long				letters[26];
+} summary_t;
+
+pool_t chunk_pool;
+
+int parse_chunk(void *context, void **item)
+{
+	chunk_t *chunk = (chunk_t *)*item;
+	size_t i;
+	int in_word = 0;
+
+	chunk->lines = chunk->words = 0;
+	for (i = 0; i < chunk->length; ++i) {
+		if (chunk->data[i] == '\n') {
+			++chunk->lines;
+		}
+		if (isspace((unsigned char)chunk->data[i])) {
+			in_word = 0;
+		} else if (!in_word) {
+			in_word = 1;
+			++chunk->words;
+		}
+	}
+	return 1;
+}
+
+int transform_chunk(void *context, void **item)
+{
+	chunk_t *chunk = (chunk_t *)*item;
+	size_t i;
+
+	for (i = 0; i < chunk->length; ++i) {
+		chunk->data[i] = tolower((unsigned char)chunk->data[i]);
+	}
+	return 1;
+}
+
+void *aggregate_init(void *arg)
+{
+	summary_t *summary = calloc(1, sizeof(summary_t));
+
+	if (summary == NULL) {
+		errno_abort("Allocate memory for summary");
+	}
+	return summary;
+}
+
+int aggregate_chunk(void *context, void **item)
+{
+	summary_t *summary = (summary_t *)context;
+	chunk_t *chunk = (chunk_t *)*item;
+	size_t i;
+
+	++summary->chunks;
+	summary->bytes += chunk->length;
+	summary->lines += chunk->lines;
+	summary->words += chunk->words;
+	for (i = 0; i < chunk->length; ++i) {
+		if (chunk->data[i] >= 'a' && chunk->data[i] <= 'z') {
+			++summary->letters[chunk->data[i] - 'a'];
+		}
+	}
+	pool_free(&chunk_pool, chunk);
+	return 0;
+}
+
+int aggregate_teardown(void *context, void **item)
+{
+	*item = context;
+	return 1;
+}
+
+void release_chunk(void *item)
+{
+	pool_free(&chunk_pool, item);
+}
+
+int file_demo(const char *path, int depth, int transport, int replicas)
+{
+	int status, i, top;
+	FILE *file;
+	pipe_t pipe;
+	chunk_t *chunk;
+	summary_t *summary;
+	void *item;
+	char rest[CHUNK_SIZE];
+	size_t rest_length = 0, length;
+	struct timespec start, end;
+	double seconds;
+	stage_def_t defs[] = {
+		{NULL, parse_chunk, NULL, NULL, replicas, 0, release_chunk},
+		{NULL, transform_chunk, NULL, NULL, replicas, 0, release_chunk},
+		{aggregate_init, aggregate_chunk, aggregate_teardown, NULL, 1, 0, release_chunk},
+	};
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		fprintf(stderr, "Can't open %s, %d(%s)\n", path, errno, strerror(errno));
+		return -1;
+	}
+
+	status = pool_init(&chunk_pool, "chunk_t", sizeof(chunk_t));
 	if (status != 0) {
-		err_abort(status, "Unlock tail stage mutex");
+		err_abort(status, "Init chunk pool");
+	}
+	create_pipe(&pipe, 4, defs, depth, transport);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (1) {
+		chunk = pool_alloc(&chunk_pool);
+		if (chunk == NULL) {
+			errno_abort("Allocate memory for chunk");
+		}
+		// start with the partial last line of the previous chunk
+		memcpy(chunk->data, rest, rest_length);
+		length = rest_length + fread(chunk->data + rest_length, 1, CHUNK_SIZE - rest_length, file);
+		if (length == 0) {
+			pool_free(&chunk_pool, chunk);
+			break;
+		}
+
+		// keep a partial last line for the next chunk, unless a line fills the chunk
+		for (chunk->length = length; chunk->length > 0 && chunk->data[chunk->length - 1] != '\n'; --chunk->length) {
+			;
+		}
+		if (chunk->length == 0 || feof(file)) {
+			chunk->length = length;
+		}
+		rest_length = length - chunk->length;
+		memcpy(rest, chunk->data + chunk->length, rest_length);
+
+		pipe_send(pipe.head, chunk);
+	}
+	if (ferror(file)) {
+		fprintf(stderr, "Can't read %s, %d(%s)\n", path, errno, strerror(errno));
 	}
+	fclose(file);
 
+	pipe_close(&pipe);
+	while (pipe_next(&pipe, &item)) {
+		summary = (summary_t *)item;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+		for (top = 0, i = 1; i < 26; ++i) {
+			if (summary->letters[i] > summary->letters[top]) {
+				top = i;
+			}
+		}
+		printf("%ld bytes, %ld lines, %ld words in %ld chunks, most common letter '%c', %.3fs (%.1f MB/s)\n",
+				summary->bytes, summary->lines, summary->words, summary->chunks, 'a' + top,
+				seconds, summary->bytes / seconds / 1e6);
+		free(summary);
+	}
+	pipe_dump(&pipe);
+	pipe_drain(&pipe, NULL);
+	pool_stats(&chunk_pool);
+	return 0;
+}
+
+/*
+ * start items for the complete lines at the front of line, of length
+ * bytes, and remove them, return 0 when all are started, or EAGAIN when
+ * the pipe is full, and the rest of the lines wait for room
+ */
+int event_lines(pipe_t *pipe, char *line, size_t *length)
+{
+	char *end;
+	int status;
+
+	while ((end = strchr(line, '\n')) != NULL) {
+		*end = '\0';
+		if (strcmp(line, "#") == 0) {
+			pipe_dump(pipe);
+		} else if (strlen(line) > 0) {
+			status = pipe_try_start(pipe, (void *)(intptr_t)strtol(line, NULL, 10));
+			if (status == EAGAIN) {
+				*end = '\n';
+				return status;
+			}
+			if (status != 0) {
+				err_abort(status, "Start item");
+			}
+		}
+		*length -= end + 1 - line;
+		memmove(line, end + 1, *length + 1);
+	}
+	return 0;
+}
+
+/*
+ * Event loop mode: one epoll set has stdin and the pipe's event fd, lines
+ * of numbers start items and results are printed as they come out,
+ * without a thread blocked on either. Only this thread takes results, so
+ * when the pipe is full stdin is dropped from the set, and the lines left
+ * are started as results make room.
+ */
+int event_loop(pipe_t *pipe)
+{
+	int epoll_fd, count, events, i, waiting = 0, eof = 0, skip = 0;
+	struct epoll_event event;
+	char line[128], *end;
+	size_t length = 0;
+	ssize_t bytes;
+	uint64_t counter;
+	void *results[PIPE_DEPTH];
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		errno_abort("Create epoll");
+	}
+	event.events = EPOLLIN;
+	event.data.fd = 0;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, 0, &event) != 0) {
+		errno_abort("Add stdin to epoll");
+	}
+	event.data.fd = pipe_event_fd(pipe);
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event) != 0) {
+		errno_abort("Add pipe event fd to epoll");
+	}
+
+	printf("Enter numbers as input, results are printed when ready, '#' for stage stats\n");
+	while (!eof || waiting) {
+		events = epoll_wait(epoll_fd, &event, 1, -1);
+		if (events < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			errno_abort("Wait on epoll");
+		}
+
+		if (event.data.fd != 0) {
+			// reset the counter first, so results arriving while draining make it readable again
+			if (read(event.data.fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+				errno_abort("Read pipe event fd");
+			}
+			while ((count = pipe_results(pipe, results, PIPE_DEPTH, &pipe_nowait)) > 0) {
+				for (i = 0; i < count; ++i) {
+					printf("Result is %ld\n", (long)(intptr_t)results[i]);
+				}
+			}
+			if (waiting) {
+				waiting = event_lines(pipe, line, &length) == EAGAIN;
+				event.events = EPOLLIN;
+				event.data.fd = 0;
+				if (!waiting && !eof && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, 0, &event) != 0) {
+					errno_abort("Add stdin to epoll");
+				}
+			}
+			continue;
+		}
+
+		// stdin is read without stdio, which would hide buffered lines from epoll
+		bytes = read(0, line + length, sizeof(line) - 1 - length);
+		if (bytes < 0) {
+			errno_abort("Read stdin");
+		}
+		length += bytes;
+		line[length] = '\0';
+		if (bytes == 0) {
+			eof = 1;
+		} else if (skip) {
+			// the rest of a line too long, up to its newline
+			end = strchr(line, '\n');
+			if (end == NULL) {
+				length = 0;
+				continue;
+			}
+			skip = 0;
+			length -= end + 1 - line;
+			memmove(line, end + 1, length + 1);
+		}
+		waiting = event_lines(pipe, line, &length) == EAGAIN;
+		if (!waiting && length == sizeof(line) - 1) {
+			fprintf(stderr, "Line too long, ignored\n");
+			skip = 1;
+			length = 0;
+		}
+		// the event fd says when there's room again
+		if ((waiting || eof) && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, 0, NULL) != 0) {
+			errno_abort("Remove stdin from epoll");
+		}
+	}
+
+	// stdin is closed, wait for the rest
+	while (pipe_result(pipe, results)) {
+		printf("Result is %ld\n", (long)(intptr_t)results[0]);
+	}
+	close(epoll_fd);
+	return 0;
+}
+
+/*
+ * Stress mode: create pipelines of random shape, push a few items, and
+ * tear them down at once with pipe_drain or pipe_abort, then check every
+ * item and stage context was freed exactly once, and that no thread or
+ * heap was left behind. Items are malloc'd longs, so leaks show up in the
+ * heap in use, and stage contexts are counted like items.
+ */
+long stress_live;
+
+void *stress_init(void *arg)
+{
+	long *count = malloc(sizeof(long));
+
+	if (count == NULL) {
+		errno_abort("Allocate memory for stage context");
+	}
+	*count = 0;
+	__atomic_add_fetch(&stress_live, 1, __ATOMIC_RELAXED);
+	return count;
+}
+
+int stress_process(void *context, void **item)
+{
+	++*(long *)context;
+	++*(long *)*item;
 	return 1;
 }
 
+int stress_teardown(void *context, void **item)
+{
+	free(context);
+	__atomic_sub_fetch(&stress_live, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void stress_release(void *item)
+{
+	free(item);
+	__atomic_sub_fetch(&stress_live, 1, __ATOMIC_RELAXED);
+}
+
+/* Threads: line of /proc/self/status */
+int thread_count(void)
+{
+	FILE *file;
+	char line[128];
+	int threads = -1;
+
+	file = fopen("/proc/self/status", "r");
+	if (file == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (sscanf(line, "Threads: %d", &threads) == 1) {
+			break;
+		}
+	}
+	fclose(file);
+	return threads;
+}
+
+void stress(long count)
+{
+	int i, stages, depth, transport, items, aborted, threads;
+	long n, *item, errors = 0;
+	size_t heap = 0;
+	pipe_t pipe;
+	stage_def_t defs[8];
+	struct timespec start, end;
+	double seconds, total[2] = {0, 0}, longest[2] = {0, 0};
+	long runs[2] = {0, 0};
+
+	srand(1);
+	threads = thread_count();
+	for (n = 0; n < count; ++n) {
+		stages = 2 + rand() % 7;
+		depth = 1 + rand() % 32;
+		transport = rand() % 2;
+		memset(defs, 0, sizeof(defs));
+		for (i = 0; i < stages - 1; ++i) {
+			defs[i].init = stress_init;
+			defs[i].process = stress_process;
+			defs[i].teardown = stress_teardown;
+			defs[i].release = stress_release;
+		}
+		// replicate the middle stage
+		defs[(stages - 1) / 2].replicas = 1 + rand() % 3;
+		defs[(stages - 1) / 2].ordered = rand() % 2;
+		create_pipe(&pipe, stages, defs, depth, transport);
+
+		// fewer than the rings hold, so the sender never blocks
+		items = rand() % (pipe.depth * stages);
+		for (i = 0; i < items; ++i) {
+			item = malloc(sizeof(long));
+			if (item == NULL) {
+				errno_abort("Allocate memory for stress item");
+			}
+			*item = 0;
+			__atomic_add_fetch(&stress_live, 1, __ATOMIC_RELAXED);
+			pipe_start(&pipe, item);
+		}
+
+		aborted = rand() % 2;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (aborted) {
+			pipe_abort(&pipe, stress_release);
+		} else {
+			pipe_drain(&pipe, stress_release);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		total[aborted] += seconds;
+		++runs[aborted];
+		if (seconds > longest[aborted]) {
+			longest[aborted] = seconds;
+		}
+
+		if (__atomic_load_n(&stress_live, __ATOMIC_RELAXED) != 0 || thread_count() != threads) {
+			++errors;
+			stress_live = 0;
+		}
+		// heap in use once allocator caches are warm
+		if (n == count / 10) {
+			heap = mallinfo2().uordblks;
+		}
+	}
+
+	for (aborted = 0; aborted < 2; ++aborted) {
+		printf("%s: %ld pipelines, teardown avg %.1f us, max %.1f us\n",
+				aborted ? "pipe_abort" : "pipe_drain", runs[aborted],
+				runs[aborted] > 0 ? total[aborted] * 1e6 / runs[aborted] : 0, longest[aborted] * 1e6);
+	}
+	printf("threads %d before, %d after, heap in use %zu bytes after warm up, %zu at end%s\n",
+			threads, thread_count(), heap, mallinfo2().uordblks,
+			errors == 0 ? "" : ", BAD TEARDOWN");
+}
+
 int main(int argc, char **argv)
 {
 	char line[128];
 	pipe_t pipe;
-	long result, data;
+	long data, items = 0;
+	void *result;
+	char *file = NULL;
+	int i, depth = PIPE_DEPTH, transport = PIPE_LOCKED, bench = 0, replicas = 1, events = 0;
+	double seconds;
+	struct timespec abstime;
 
-	create_pipe(&pipe, 5);
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			depth = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			++i;
+			for (transport = PIPE_SPSC; transport >= 0; --transport) {
+				if (strcmp(argv[i], transport_names[transport]) == 0) {
+					break;
+				}
+			}
+		} else if (strcmp(argv[i], "-e") == 0) {
+			events = 1;
+		} else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+			replicas = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+			file = argv[++i];
+		} else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "-l") == 0
+				|| strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "-s") == 0) {
+			bench = argv[i][1];
+			if (i + 1 < argc) {
+				items = atol(argv[++i]);
+			}
+		} else {
+			depth = 0;
+		}
+		if (depth < 1 || transport < 0 || replicas < 1) {
+			fprintf(stderr, "%s [-d depth] [-t locked|spsc] [-e]\n"
+					"%s -b [items]\n"
+					"%s -l [items]\n"
+					"%s -r [items]\n"
+					"%s -s [pipelines]\n"
+					"%s [-d depth] [-t locked|spsc] [-R replicas] -f file\n",
+					argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+			return -1;
+		}
+	}
+
+	if (bench == 'b') {
+		benchmark(items > 0 ? items : 1000000, PIPE_LOCKED);
+		benchmark(items > 0 ? items : 1000000, PIPE_SPSC);
+		return 0;
+	}
+	if (bench == 'r') {
+		replica_benchmark(items > 0 ? items : 20000, PIPE_LOCKED);
+		replica_benchmark(items > 0 ? items : 20000, PIPE_SPSC);
+		return 0;
+	}
+	if (bench == 's') {
+		stress(items > 0 ? items : 1000);
+		return 0;
+	}
+	if (bench == 'l') {
+		latency_benchmark(items > 0 ? items : 100000, PIPE_LOCKED);
+		latency_benchmark(items > 0 ? items : 100000, PIPE_SPSC);
+		return 0;
+	}
+
+	if (file != NULL) {
+		return file_demo(file, depth, transport, replicas);
+	}
+
+	create_add_pipe(&pipe, 5, depth, transport);
+	if (events) {
+		return event_loop(&pipe);
+	}
+	printf("Enter a number as input or '=' character to get result,\n"
+			"'= seconds' to wait at most seconds for it, '?' to not wait, '#' for stage stats\n");
 
 	while (1) {
 		printf("Data>\n");
@@ -255,15 +2143,36 @@ int main(int argc, char **argv)
 
 		if (strlen(line) == 2 && line[0] == '=') {
 			if (pipe_result(&pipe, &result)) {
-				printf("Result is %ld\n", result);
+				printf("Result is %ld\n", (long)(intptr_t)result);
 			} else {
 				printf("The pipe is empty\n");
 			}
+		} else if (strlen(line) == 2 && line[0] == '#') {
+			pipe_dump(&pipe);
+		} else if (strlen(line) == 2 && line[0] == '?') {
+			if (pipe_result_try(&pipe, &result)) {
+				printf("Result is %ld\n", (long)(intptr_t)result);
+			} else {
+				printf("No result ready\n");
+			}
+		} else if (sscanf(line, "= %lf", &seconds) == 1) {
+			clock_gettime(CLOCK_REALTIME, &abstime);
+			abstime.tv_sec += (time_t)seconds;
+			abstime.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+			if (abstime.tv_nsec >= 1000000000L) {
+				++abstime.tv_sec;
+				abstime.tv_nsec -= 1000000000L;
+			}
+			if (pipe_result_timed(&pipe, &result, &abstime)) {
+				printf("Result is %ld\n", (long)(intptr_t)result);
+			} else {
+				printf("No result within %g seconds\n", seconds);
+			}
 		} else {
 			if (sscanf(line, "%ld", &data) != 1) {
 				fprintf(stderr, "Bad input data\n");
 			} else {
-				pipe_start(&pipe, data);
+				pipe_start(&pipe, (void *)(intptr_t)data);
 			}
 		}
 	}
@@ -0,0 +1,327 @@
+#ifndef __pool_h
+#define __pool_h
+
+#include <pthread.h>
+#include "errors.h"
+
+/*
+ * Fixed-size object pool with per-thread caches, for the small nodes
+ * examples allocate and free at high rates (alarms, requests, work items).
+ *
+ * Each thread allocates from and frees into its own free list found
+ * through a thread-specific data key, so the common path takes no lock.
+ * A thread cache that runs dry takes a whole chain of POOL_BATCH objects
+ * from the pool, and one that grows to twice POOL_BATCH gives a chain
+ * back, so objects allocated by one thread and freed by another flow
+ * back to the pool. Only refilling an empty pool calls malloc, once per
+ * POOL_BATCH objects. Objects go back to malloc only with pool_destroy,
+ * which frees the slabs they were cut from.
+ *
+ * A thread that only ever frees one object, like a one-shot thread, frees
+ * it with pool_free_remote instead, which pushes it on the pool's remote
+ * list with a CAS and gives the thread no cache. A refill takes the whole
+ * remote list at once before looking at the chains.
+ *
+ * The first two words of a free object link it into its chain and link
+ * chains together, so objects are at least two pointers big.
+ */
+#define	POOL_BATCH	64
+
+typedef struct pool_cache_tag {
+	struct pool_cache_tag		*next;		/* in pool's cache list */
+	struct pool_tag			*pool;
+	void				*free;		/* thread's free list */
+	int				count;		/* objects in free list */
+	long				allocs;
+	long				frees;
+} pool_cache_t;
+
+typedef struct pool_tag {
+	const char			*name;
+	size_t				size;		/* object size */
+	pthread_key_t			key;		/* thread's pool_cache_t */
+	// protect access to fields below
+	pthread_mutex_t			mutex;
+	void				*chains;	/* chains of free objects */
+	void				*slabs;		/* slabs allocated, for pool_destroy */
+	// lock-free, pushed by pool_free_remote and taken whole by pool_refill
+	void				*remote;	/* objects freed by threads without a cache */
+	long				remote_frees;
+	pool_cache_t			*caches;	/* caches of live threads */
+	long				mallocs;	/* slabs allocated */
+	long				allocs;		/* allocations of exited threads */
+	long				frees;		/* frees of exited threads */
+} pool_t;
+
+#define	POOL_NEXT(object)	(*(void **)(object))
+#define	POOL_CHAIN(object)	(((void **)(object))[1])
+
+/* push a free list as one chain to pool, caller MUST have pool mutex locked */
+static inline void pool_push_chain(pool_t *pool, void *chain)
+{
+	POOL_CHAIN(chain) = pool->chains;
+	pool->chains = chain;
+}
+
+/* thread exit, give cached objects and counters back to pool */
+static inline void pool_cache_destroy(void *arg)
+{
+	int status;
+	pool_cache_t *cache = (pool_cache_t *)arg, **link;
+	pool_t *pool = cache->pool;
+
+	status = pthread_mutex_lock(&pool->mutex);
+	if (status != 0) {
+		err_abort(status, "Lock pool mutex");
+	}
+	if (cache->free != NULL) {
+		pool_push_chain(pool, cache->free);
+	}
+	pool->allocs += cache->allocs;
+	pool->frees += cache->frees;
+	for (link = &pool->caches; *link != cache; link = &(*link)->next) {
+		;
+	}
+	*link = cache->next;
+	status = pthread_mutex_unlock(&pool->mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock pool mutex");
+	}
+	free(cache);
+}
+
+/* return status, like pthread_*_init */
+static inline int pool_init(pool_t *pool, const char *name, size_t size)
+{
+	int status;
+
+	// keep objects aligned for any type, and big enough for the two links
+	size = (size + 2 * sizeof(void *) - 1) / (2 * sizeof(void *)) * (2 * sizeof(void *));
+
+	pool->name = name;
+	pool->size = size;
+	pool->chains = NULL;
+	pool->slabs = NULL;
+	pool->remote = NULL;
+	pool->remote_frees = 0;
+	pool->caches = NULL;
+	pool->mallocs = pool->allocs = pool->frees = 0;
+
+	status = pthread_mutex_init(&pool->mutex, NULL);
+	if (status != 0) {
+		return status;
+	}
+	return pthread_key_create(&pool->key, pool_cache_destroy);
+}
+
+/* cache of calling thread, created on first use */
+static inline pool_cache_t *pool_cache(pool_t *pool)
+{
+	int status;
+	pool_cache_t *cache = pthread_getspecific(pool->key);
+
+	if (cache != NULL) {
+		return cache;
+	}
+
+	cache = calloc(1, sizeof(pool_cache_t));
+	if (cache == NULL) {
+		errno_abort("Allocate pool cache");
+	}
+	cache->pool = pool;
+	status = pthread_setspecific(pool->key, cache);
+	if (status != 0) {
+		err_abort(status, "Set pool cache");
+	}
+
+	status = pthread_mutex_lock(&pool->mutex);
+	if (status != 0) {
+		err_abort(status, "Lock pool mutex");
+	}
+	cache->next = pool->caches;
+	pool->caches = cache;
+	status = pthread_mutex_unlock(&pool->mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock pool mutex");
+	}
+	return cache;
+}
+
+/*
+ * refill an empty cache with the remote list, or one chain, from pool or
+ * a new slab, a slab has room for one more object in front, which links
+ * it to pool's slabs
+ */
+static inline void pool_refill(pool_t *pool, pool_cache_t *cache)
+{
+	int status, i;
+	char *slab = NULL;
+	void *chain;
+
+	// only ever taken whole, so a pop can't see a node reused under it
+	chain = __atomic_exchange_n(&pool->remote, NULL, __ATOMIC_ACQUIRE);
+	if (chain != NULL) {
+		cache->free = chain;
+		for (cache->count = 0; chain != NULL; chain = POOL_NEXT(chain)) {
+			++cache->count;
+		}
+		return;
+	}
+
+	status = pthread_mutex_lock(&pool->mutex);
+	if (status != 0) {
+		err_abort(status, "Lock pool mutex");
+	}
+	chain = pool->chains;
+	if (chain != NULL) {
+		pool->chains = POOL_CHAIN(chain);
+	} else {
+		++pool->mallocs;
+	}
+	status = pthread_mutex_unlock(&pool->mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock pool mutex");
+	}
+
+	if (chain == NULL) {
+		slab = malloc((POOL_BATCH + 1) * pool->size);
+		if (slab == NULL) {
+			return;
+		}
+		status = pthread_mutex_lock(&pool->mutex);
+		if (status != 0) {
+			err_abort(status, "Lock pool mutex");
+		}
+		POOL_NEXT(slab) = pool->slabs;
+		pool->slabs = slab;
+		status = pthread_mutex_unlock(&pool->mutex);
+		if (status != 0) {
+			err_abort(status, "Unlock pool mutex");
+		}
+		slab += pool->size;
+		for (i = 0; i < POOL_BATCH - 1; ++i) {
+			POOL_NEXT(slab + i * pool->size) = slab + (i + 1) * pool->size;
+		}
+		POOL_NEXT(slab + i * pool->size) = NULL;
+		chain = slab;
+	}
+
+	cache->free = chain;
+	for (cache->count = 0; chain != NULL; chain = POOL_NEXT(chain)) {
+		++cache->count;
+	}
+}
+
+/* return NULL when out of memory, like malloc */
+static inline void *pool_alloc(pool_t *pool)
+{
+	pool_cache_t *cache = pool_cache(pool);
+	void *object;
+
+	if (cache->free == NULL) {
+		pool_refill(pool, cache);
+		if (cache->free == NULL) {
+			return NULL;
+		}
+	}
+	object = cache->free;
+	cache->free = POOL_NEXT(object);
+	--cache->count;
+	++cache->allocs;
+	return object;
+}
+
+static inline void pool_free(pool_t *pool, void *object)
+{
+	int status, i;
+	pool_cache_t *cache = pool_cache(pool);
+	void *chain, *last;
+
+	POOL_NEXT(object) = cache->free;
+	cache->free = object;
+	++cache->count;
+	++cache->frees;
+
+	if (cache->count < 2 * POOL_BATCH) {
+		return;
+	}
+
+	// cut one chain off the free list outside the lock, then push it
+	chain = cache->free;
+	for (last = chain, i = 1; i < POOL_BATCH; ++i) {
+		last = POOL_NEXT(last);
+	}
+	cache->free = POOL_NEXT(last);
+	POOL_NEXT(last) = NULL;
+	cache->count -= POOL_BATCH;
+
+	status = pthread_mutex_lock(&pool->mutex);
+	if (status != 0) {
+		err_abort(status, "Lock pool mutex");
+	}
+	pool_push_chain(pool, chain);
+	status = pthread_mutex_unlock(&pool->mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock pool mutex");
+	}
+}
+
+/* free object without a thread cache, for a thread that frees nothing else */
+static inline void pool_free_remote(pool_t *pool, void *object)
+{
+	void *next = __atomic_load_n(&pool->remote, __ATOMIC_RELAXED);
+
+	do {
+		POOL_NEXT(object) = next;
+	} while (!__atomic_compare_exchange_n(&pool->remote, &next, object, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	__atomic_add_fetch(&pool->remote_frees, 1, __ATOMIC_RELAXED);
+}
+
+/* print allocation counters, counters of running threads may lag */
+static inline void pool_stats(pool_t *pool)
+{
+	int status;
+	long allocs, frees;
+	pool_cache_t *cache;
+
+	status = pthread_mutex_lock(&pool->mutex);
+	if (status != 0) {
+		err_abort(status, "Lock pool mutex");
+	}
+	allocs = pool->allocs;
+	frees = pool->frees + __atomic_load_n(&pool->remote_frees, __ATOMIC_RELAXED);
+	for (cache = pool->caches; cache != NULL; cache = cache->next) {
+		allocs += cache->allocs;
+		frees += cache->frees;
+	}
+	printf("%s pool: %ld allocs, %ld frees, %ld mallocs of %d x %zu bytes\n",
+			pool->name, allocs, frees, pool->mallocs, POOL_BATCH, pool->size);
+	status = pthread_mutex_unlock(&pool->mutex);
+	if (status != 0) {
+		err_abort(status, "Unlock pool mutex");
+	}
+}
+
+/*
+ * free pool and all of its objects, the threads that used it MUST be done
+ * with it, caches of threads still alive are freed with it
+ */
+static inline void pool_destroy(pool_t *pool)
+{
+	pool_cache_t *cache, *next;
+	void *slab, *next_slab;
+
+	pthread_key_delete(pool->key);
+	for (cache = pool->caches; cache != NULL; cache = next) {
+		next = cache->next;
+		free(cache);
+	}
+	for (slab = pool->slabs; slab != NULL; slab = next_slab) {
+		next_slab = POOL_NEXT(slab);
+		free(slab);
+	}
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+#endif
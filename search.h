@@ -0,0 +1,141 @@
+#ifndef __search_h
+#define __search_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define	SEARCH_X86	1
+#endif
+
+/*
+ * Substring search over a block of bytes, for scanning files in large
+ * reads instead of per line. A block may hold NUL bytes and has no line
+ * structure, so a match is found wherever it is.
+ *
+ * The vector kernels compare the first and the last byte of the needle
+ * against 16 or 32 positions at once, and only compare the whole needle
+ * where both match, so text that merely shares the first byte is
+ * skipped (Mula's "generic SIMD" strstr). The kernel is picked once from
+ * what the CPU supports, AVX2, then SSE2, then a memchr based one.
+ *
+ * Callers scanning a stream in blocks keep the last length - 1 bytes of a
+ * block in front of the next one, so matches across blocks are found.
+ */
+typedef const char *(*search_kernel_t)(const char *block, size_t size,
+		const char *needle, size_t length);
+
+/* memchr for the first byte, then memcmp the rest */
+static inline const char *search_scalar(const char *block, size_t size,
+		const char *needle, size_t length)
+{
+	const char *end = block + size, *next;
+
+	if (length == 0) {
+		return block;
+	}
+	while ((size_t)(end - block) >= length) {
+		next = memchr(block, needle[0], end - block - length + 1);
+		if (next == NULL) {
+			return NULL;
+		}
+		if (memcmp(next + 1, needle + 1, length - 1) == 0) {
+			return next;
+		}
+		block = next + 1;
+	}
+	return NULL;
+}
+
+#ifdef SEARCH_X86
+static inline const char *search_sse2(const char *block, size_t size,
+		const char *needle, size_t length)
+{
+	__m128i first, last, block_first, block_last;
+	unsigned int mask;
+	size_t i;
+	int bit;
+
+	if (length < 2 || size < length + 16) {
+		return search_scalar(block, size, needle, length);
+	}
+	first = _mm_set1_epi8(needle[0]);
+	last = _mm_set1_epi8(needle[length - 1]);
+
+	// i + 15 + length - 1 stays inside block
+	for (i = 0; i + length + 15 <= size; i += 16) {
+		block_first = _mm_loadu_si128((const __m128i *)(block + i));
+		block_last = _mm_loadu_si128((const __m128i *)(block + i + length - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+					_mm_cmpeq_epi8(block_last, last)));
+		while (mask != 0) {
+			bit = __builtin_ctz(mask);
+			if (memcmp(block + i + bit + 1, needle + 1, length - 2) == 0) {
+				return block + i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+	return search_scalar(block + i, size - i, needle, length);
+}
+
+__attribute__((target("avx2")))
+static inline const char *search_avx2(const char *block, size_t size,
+		const char *needle, size_t length)
+{
+	__m256i first, last, block_first, block_last;
+	unsigned int mask;
+	size_t i;
+	int bit;
+
+	if (length < 2 || size < length + 32) {
+		return search_scalar(block, size, needle, length);
+	}
+	first = _mm256_set1_epi8(needle[0]);
+	last = _mm256_set1_epi8(needle[length - 1]);
+
+	for (i = 0; i + length + 31 <= size; i += 32) {
+		block_first = _mm256_loadu_si256((const __m256i *)(block + i));
+		block_last = _mm256_loadu_si256((const __m256i *)(block + i + length - 1));
+		mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+					_mm256_cmpeq_epi8(block_last, last)));
+		while (mask != 0) {
+			bit = __builtin_ctz(mask);
+			if (memcmp(block + i + bit + 1, needle + 1, length - 2) == 0) {
+				return block + i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+	return search_scalar(block + i, size - i, needle, length);
+}
+#endif
+
+static search_kernel_t search_kernel = search_scalar;
+static const char *search_kernel_name = "scalar";
+static pthread_once_t search_once = PTHREAD_ONCE_INIT;
+
+static void search_dispatch(void)
+{
+#ifdef SEARCH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		search_kernel = search_avx2;
+		search_kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2")) {
+		search_kernel = search_sse2;
+		search_kernel_name = "sse2";
+	}
+#endif
+}
+
+/* first match of needle in block, or NULL, with the best kernel of this CPU */
+static inline const char *search_block(const char *block, size_t size,
+		const char *needle, size_t length)
+{
+	pthread_once(&search_once, search_dispatch);
+	return search_kernel(block, size, needle, length);
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include <pthread.h>
 #include "errors.h"
+#include "pool.h"
 
 #define	REQ_READ	1
 #define REQ_WRITE	2
@@ -48,9 +49,12 @@ int client_thread;
 static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t client_cond = PTHREAD_COND_INITIALIZER;
 
+// requests are allocated by clients, freed by server thread or by sync client
+static pool_t request_pool;
+
 void *server_routine(void *arg)
 {
-	int status, len;
+	int status, len, operation;
 	request_t *request;
 	while (1) {
 		status = pthread_mutex_lock(&server.mutex);
@@ -107,6 +111,8 @@ void *server_routine(void *arg)
 
 		}
 
+		// request may be freed below
+		operation = request->operation;
 		if (request->synchronous) {
 			status = pthread_mutex_lock(&server.mutex);
 			if (status != 0) {
@@ -123,10 +129,10 @@ void *server_routine(void *arg)
 			}
 		}
 		else {
-			free(request);
+			pool_free(&request_pool, request);
 		}
 
-		if (request->operation == REQ_QUIT) {
+		if (operation == REQ_QUIT) {
 			break;
 		}
 	}
@@ -172,7 +178,7 @@ void tty_server_request(int operation, int sync, const char *prompt, char *strin
 	}
 
 	// add request
-	request = malloc(sizeof(request_t));
+	request = pool_alloc(&request_pool);
 	if (request == NULL) {
 		errno_abort("Allocate memory for request");
 	}
@@ -230,7 +236,7 @@ void tty_server_request(int operation, int sync, const char *prompt, char *strin
 		if (status != 0) {
 			err_abort(status, "Destroy request done cond");
 		}
-		free(request);
+		pool_free(&request_pool, request);
 	}
 
 	status = pthread_mutex_unlock(&server.mutex);
@@ -281,6 +287,11 @@ int main()
 	int status, i;
 	pthread_t thread;
 
+	status = pool_init(&request_pool, "request_t", sizeof(request_t));
+	if (status != 0) {
+		err_abort(status, "Init request pool");
+	}
+
 	// create client thread
 	client_thread = CLIENT_NUMBER;
 	for (i = 0; i < client_thread; ++i) {
@@ -312,5 +323,6 @@ int main()
 
 	// quit server thread
 	tty_server_request(REQ_QUIT, 1, NULL, NULL);
+	pool_stats(&request_pool);
 	return 0;
 }